@@ -0,0 +1,298 @@
+// Copyright © 2008-2024 David Caldwell <david@porkrind.org>
+// Copyright © 2009      Jim Radford <radford@blackbean.org>
+
+// The command language: splitting lines into words, finding the command and matching the words up with its arguments.
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <err.h>
+#include "lengthof.h"
+#include "mbr.h"
+#include "xmem.h"
+#include "dalloc.h"
+#include "gdisk.h"
+
+// Splits |line| into words in place. Words are separated by whitespace. Inside '...' everything is literal; inside
+// "..." a backslash escapes the next character; outside quotes a backslash escapes the next character, too. Quotes can
+// start in the middle of a word, so --label="a b" is one word: --label=a b. Unescaping only ever makes a word
+// shorter, so it's done in the same pass, writing just behind the read pointer.
+//
+// The words go in |fixed| (which has room for |fixed_size| pointers) if they fit, and an arena array otherwise. The
+// result is NULL terminated. Returns NULL (after complaining) if a quote isn't closed.
+static char **parse_command(char *line, char **fixed, int fixed_size)
+{
+    char **v = fixed;
+    int c = 0, size = fixed_size;
+    char *in = line, *out = line;
+    for (;;) {
+        while (isspace((unsigned char)*in)) in++;
+        if (!*in) break;
+        if (c + 1 >= size) {
+            char **bigger = dalloc(sizeof(*v) * size * 2);
+            v = memcpy(bigger, v, sizeof(*v) * c);
+            size *= 2;
+        }
+        v[c++] = out;
+        for (char quote = 0; *in && (quote || !isspace((unsigned char)*in)); in++) {
+            if (quote == '\'' && *in == '\'')
+                quote = 0;
+            else if (quote == '\'')
+                *out++ = *in;
+            else if (*in == '\\' && in[1])
+                *out++ = *++in;
+            else if (*in == quote)
+                quote = 0;
+            else if (!quote && (*in == '"' || *in == '\''))
+                quote = *in;
+            else
+                *out++ = *in;
+            if (!in[1] && quote) {
+                fprintf(stderr, "Missing closing %c quote\n", quote);
+                return NULL;
+            }
+        }
+        if (*in) in++; // The separator. Safe to overwrite now.
+        *out++ = '\0';
+    }
+    v[c] = NULL;
+    return v;
+}
+
+// The reverse of parse_command(): appends |word| to |line|, quoted if it needs to be.
+static char *append_word(char *line, char *word)
+{
+    line = xstrcat(line, " ");
+    if (*word && !strpbrk(word, " \t\f\r\n\v\"'\\"))
+        return xstrcat(line, word);
+    line = xstrcat(line, "\"");
+    for (char *w = word; *w; w++)
+        line = xstrcat(line, (char[]) { *w == '"' || *w == '\\' ? '\\' : *w, *w == '"' || *w == '\\' ? *w : '\0', '\0' });
+    return xstrcat(line, "\"");
+}
+
+// All the commands, sorted by name (for help and completion), and a hash of them for lookups. The hash gets a seed
+// that leaves no collisions, so a lookup is one hash and one strcmp(). It's built once, the first time anything asks,
+// and only read after that.
+static pthread_once_t commands_once = PTHREAD_ONCE_INIT;
+static struct {
+    int count;
+    struct command **sorted;
+    struct command **hash;
+    unsigned mask, seed;
+} commands;
+
+static unsigned command_hash(const char *name, unsigned seed)
+{
+    unsigned hash = 2166136261u ^ seed; // FNV-1a
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash ^ hash >> 15;
+}
+
+static int compare_command_name(const void *a, const void *b)
+{
+    return strcmp((*(struct command **)a)->name, (*(struct command **)b)->name);
+}
+
+static void build_command_index()
+{
+    commands.count = __stop_gdisk_command - __start_gdisk_command;
+    commands.sorted = xmemdup((void *)__start_gdisk_command, sizeof(*commands.sorted) * commands.count);
+    qsort(commands.sorted, commands.count, sizeof(*commands.sorted), compare_command_name);
+    // Two commands with the same name would always collide and no seed or size could ever fix it.
+    for (int c=1; c<commands.count; c++)
+        if (strcmp(commands.sorted[c-1]->name, commands.sorted[c]->name) == 0)
+            errx(1, "Command \"%s\" is defined more than once", commands.sorted[c]->name);
+
+    unsigned size = 1;
+    while (size < commands.count * 2)
+        size *= 2;
+    for (unsigned seed = 0;; seed++) {
+        if (seed == 1000) { // Unlucky with this size. Give the seeds more room.
+            size *= 2;
+            seed = 0;
+        }
+        free(commands.hash);
+        commands.hash = xcalloc(size, sizeof(*commands.hash));
+        int c;
+        for (c=0; c<commands.count; c++) {
+            struct command **slot = &commands.hash[command_hash(commands.sorted[c]->name, seed) & (size - 1)];
+            if (*slot) break;
+            *slot = commands.sorted[c];
+        }
+        if (c == commands.count) {
+            commands.mask = size - 1;
+            commands.seed = seed;
+            return;
+        }
+    }
+}
+
+static void index_commands()
+{
+    pthread_once(&commands_once, build_command_index);
+}
+
+struct command **command_list(int *count)
+{
+    index_commands();
+    *count = commands.count;
+    return commands.sorted;
+}
+
+struct command *find_command(char *command)
+{
+    index_commands();
+    struct command *c = commands.hash[command_hash(command, commands.seed) & commands.mask];
+    return c && strcmp(command, c->name) == 0 ? c : NULL;
+}
+
+int run_command(struct partition_table *t, char *line, char **final_line, command_prompt prompt)
+{
+    if (final_line) *final_line = xstrdup(line);
+    dalloc_start();
+    int status = 0;
+    char **cmdv = NULL;
+    char *fixed[16];
+    char **argv = parse_command(line, fixed, lengthof(fixed));
+    if (!argv) {
+        status = EINVAL;
+        goto done;
+    }
+    int argc;
+    for (argc=0; argv[argc]; argc++) {}
+    if (!argc) goto done; // Blank line
+
+    struct command *c = find_command(argv[0]);
+    if (!c) {
+        printf("Command not found: '%s'\n", argv[0]);
+        status = EINVAL;
+        goto done;
+    }
+
+    int args;
+    for (args=0; c->arg[args].name; args++) {}
+
+    cmdv = dcalloc(1+args+1, sizeof(*argv));
+    cmdv[0] = argv[0];
+    for (int i=1; i<argc; i++) {
+        if (argv[i][0] == '-') {
+            char *rest = argv[i];
+            char *name = strsep(&rest, "=");
+            while (*name == '-') name++;
+            for (int a=0; a<args; a++)
+                if (strcmp(c->arg[a].name, name) == 0) {
+                    char **arg = &cmdv[a+1];
+                    if (c->arg[a].type == C_Flag)
+                        *arg = argv[i];
+                    else if (!rest  || !*rest)
+                        if (i+1 >= argc) {
+                            fprintf(stderr, "Missing parameter for argument \"%s\"\n", name);
+                            status = EINVAL;
+                            goto done;
+                        } else
+                            *arg = argv[++i];
+                    else
+                        *arg = rest;
+                    goto found;
+                }
+            fprintf(stderr, "Command \"%s\" has no such argument \"%s\". Try 'help %s'\n", c->name, name, c->name);
+            status = EINVAL;
+            goto done;
+        } else {
+            for (int o=1; o<args+1; o++)
+                if (!cmdv[o] && c->arg[o-1].type != C_Flag) {
+                    cmdv[o] = argv[i];
+                    goto found;
+                }
+            fprintf(stderr, "Too many arguments for command '%s'\n", argv[0]);
+            status = EINVAL;
+            goto done;
+        }
+      found:;
+    }
+
+    char **v = cmdv + 1; // start past command name.
+    for (int a=0; a<args; a++, v++) {
+        if (*v) continue; // Don't prompt for args entered on command line.
+        if (c->arg[a].type & C_Optional)
+            continue;
+        if (!prompt) {
+            fprintf(stderr, "%s: Missing %s (%s)\n", c->name, arg_name(&c->arg[a]), c->arg[a].help);
+            status = EINVAL;
+            goto done;
+        }
+        *v = dalloc_remember(prompt(c, &c->arg[a]));
+        if (!*v) goto done;
+        *v = trim(*v);
+
+        if (final_line)
+            *final_line = append_word(*final_line, *v);
+    }
+
+    status = c->handler(t, cmdv);
+
+  done:
+    dalloc_free();
+    return status;
+}
+
+char *arg_name(struct command_arg_ *arg)
+{
+    return dsprintf("%s%s%s",
+                    arg->type == C_Flag ? "--" : "<",
+                    arg->name,
+                    arg->type == C_Flag ? ""   : ">");
+}
+
+// Runs command |name| without going through the command language. |arg| has |args| arguments in the order the
+// command declares them, with NULL for the ones left out.
+int call_command(struct partition_table *t, char *name, char **arg, int args)
+{
+    struct command *c = find_command(name);
+    if (!c) {
+        printf("Command not found: '%s'\n", name);
+        return EINVAL;
+    }
+    int count;
+    for (count=0; c->arg[count].name; count++) {}
+    if (args > count) {
+        fprintf(stderr, "Too many arguments for command '%s'\n", name);
+        return EINVAL;
+    }
+
+    dalloc_start();
+    int status = 0;
+    char **cmdv = dcalloc(1+count+1, sizeof(*cmdv));
+    cmdv[0] = name;
+    for (int a=0; a<count; a++) {
+        cmdv[a+1] = a < args ? arg[a] : NULL;
+        if (!cmdv[a+1] && !(c->arg[a].type & C_Optional)) {
+            fprintf(stderr, "%s: Missing %s (%s)\n", c->name, arg_name(&c->arg[a]), c->arg[a].help);
+            status = EINVAL;
+            goto done;
+        }
+    }
+
+    status = c->handler(t, cmdv);
+
+  done:
+    dalloc_free();
+    return status;
+}
+
+char *trim(char *s)
+{
+    while (isspace(*s)) s++;
+    char *e = s+strlen(s) - 1;
+    while (e >= s && isspace(*e))
+        *e-- = '\0';
+    return s;
+}
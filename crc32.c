@@ -0,0 +1,258 @@
+//  Copyright (c) 2024 David Caldwell,  All Rights Reserved.
+
+// CRC-32 for GPT headers and partition arrays. There's a carry-less multiply version for x86-64 (see "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction", Gopal et al, Intel, 2009), one that uses the
+// ARMv8 CRC32 instructions, and a portable slice-by-8 table version. The best one for the CPU is picked at startup.
+//
+// The kernels all work on the raw CRC register. gpt_crc32() does the pre and post inversion.
+
+#include <stdbool.h>
+#include <string.h>
+#include "lengthof.h"
+#include "crc32.h"
+
+#define POLY 0xedb88320 // reflected 0x04c11db7
+
+static uint32_t table[8][256];
+static uint32_t x2n_table[32]; // x^(2^n) mod P
+
+static void init_tables()
+{
+    for (int i=0; i<256; i++) {
+        uint32_t c = i;
+        for (int k=0; k<8; k++)
+            c = c & 1 ? c >> 1 ^ POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (int i=0; i<256; i++)
+        for (int t=1; t<lengthof(table); t++)
+            table[t][i] = table[t-1][i] >> 8 ^ table[0][table[t-1][i] & 0xff];
+}
+
+// a*b mod P (polynomials, bit reflected so x^0 is the top bit)
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+            if (!(a & (m - 1)))
+                break;
+        }
+        b = b & 1 ? b >> 1 ^ POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(n*2^k) mod P
+static uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+    uint32_t p = 1u << 31; // x^0
+    for (; n; n >>= 1, k++)
+        if (n & 1)
+            p = multmodp(x2n_table[k & 31], p);
+    return p;
+}
+
+static void init_x2n_table()
+{
+    uint32_t p = 1u << 30; // x^1
+    for (int n=0; n<lengthof(x2n_table); n++) {
+        x2n_table[n] = p;
+        p = multmodp(p, p);
+    }
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *p, size_t length)
+{
+    for (; length && (uintptr_t)p & 7; length--)
+        crc = crc >> 8 ^ table[0][(crc ^ *p++) & 0xff];
+    for (; length >= 8; length -= 8, p += 8) {
+        // Assembled a byte at a time so it doesn't care about host endianness. Compilers turn it into plain loads.
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi =        p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = table[7][lo       & 0xff] ^ table[6][lo >>  8 & 0xff] ^ table[5][lo >> 16 & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi       & 0xff] ^ table[2][hi >>  8 & 0xff] ^ table[1][hi >> 16 & 0xff] ^ table[0][hi >> 24];
+    }
+    while (length--)
+        crc = crc >> 8 ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// Folds 64 bytes at a time in four parallel lanes, then down to one 128 bit lane, then Barrett reduces to 32 bits.
+// |length| must be a multiple of 16 and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t pclmul_fold(uint32_t crc, const unsigned char *p, size_t length)
+{
+    // x^(4*128+32) mod P, x^(4*128-32) mod P, x^(128+32) mod P, x^(128-32) mod P, x^64 mod P (all bit reflected)
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    // P' (the bit reflected polynomial) and mu = floor(x^64 / P) for the Barrett reduction
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((__m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((__m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((__m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((__m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((__m128i *)k1k2);
+    p += 64;
+    length -= 64;
+
+    for (; length >= 64; p += 64, length -= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((__m128i *)(p + 0x00));
+        y6 = _mm_loadu_si128((__m128i *)(p + 0x10));
+        y7 = _mm_loadu_si128((__m128i *)(p + 0x20));
+        y8 = _mm_loadu_si128((__m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    }
+
+    // Four lanes down to one
+    x0 = _mm_load_si128((__m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Any 16 byte blocks left over
+    for (; length >= 16; p += 16, length -= 16) {
+        x2 = _mm_loadu_si128((__m128i *)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((__m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction down to 32
+    x0 = _mm_load_si128((__m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *p, size_t length)
+{
+    if (length >= 64) {
+        size_t folded = length & ~(size_t)15;
+        crc = pclmul_fold(crc, p, folded);
+        p += folded;
+        length -= folded;
+    }
+    return crc32_slice8(crc, p, length);
+}
+
+static bool have_pclmul()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *p, size_t length)
+{
+    for (; length && (uintptr_t)p & 7; length--)
+        crc = __crc32b(crc, *p++);
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32d(crc, word);
+    }
+    while (length--)
+        crc = __crc32b(crc, *p++);
+    return crc;
+}
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+static bool have_armv8_crc() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+#elif defined(__APPLE__)
+static bool have_armv8_crc() { return true; } // Every Apple arm64 chip has it.
+#else
+static bool have_armv8_crc() { return false; }
+#endif
+#endif
+
+static struct {
+    const char *name;
+    uint32_t (*kernel)(uint32_t crc, const unsigned char *p, size_t length);
+} impl = { "slice-by-8", crc32_slice8 };
+
+static void crc32_init() __attribute__((constructor));
+static void crc32_init()
+{
+    init_tables();
+    init_x2n_table();
+#if defined(__x86_64__)
+    if (have_pclmul()) {
+        impl.name = "pclmul";
+        impl.kernel = crc32_pclmul;
+    }
+#endif
+#if defined(__aarch64__)
+    if (have_armv8_crc()) {
+        impl.name = "armv8";
+        impl.kernel = crc32_armv8;
+    }
+#endif
+}
+
+uint32_t gpt_crc32(uint32_t crc, const void *data, size_t length)
+{
+    return ~impl.kernel(~crc, data, length);
+}
+
+uint32_t gpt_crc32_combine_gen(uint64_t length2)
+{
+    return x2nmodp(length2, 3);
+}
+
+uint32_t gpt_crc32_combine_op(uint32_t crc1, uint32_t crc2, uint32_t op)
+{
+    return multmodp(op, crc1) ^ crc2;
+}
+
+const char *gpt_crc32_implementation()
+{
+    return impl.name;
+}
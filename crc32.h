@@ -0,0 +1,22 @@
+//  Copyright (c) 2024 David Caldwell,  All Rights Reserved.
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The standard (IEEE 802.3, reflected 0xEDB88320) CRC-32 that GPT uses. Same calling convention as zlib's crc32(): start
+// with crc = 0 and pass the previous result back in to continue a running CRC. It has its own name so it can't clash
+// with zlib's when both end up in one program.
+uint32_t gpt_crc32(uint32_t crc, const void *data, size_t length);
+
+// Stitching CRCs together: if crc1 = gpt_crc32(0, A, a) and crc2 = gpt_crc32(0, B, length2) then
+// gpt_crc32_combine_op(crc1, crc2, gpt_crc32_combine_gen(length2)) == gpt_crc32(0, AB, a+length2). The op only
+// depends on length2, so it can be generated once and reused for every pair with the same second length.
+uint32_t gpt_crc32_combine_gen(uint64_t length2);
+uint32_t gpt_crc32_combine_op(uint32_t crc1, uint32_t crc2, uint32_t op);
+
+// Which implementation got picked for this CPU ("pclmul", "armv8", or "slice-by-8").
+const char *gpt_crc32_implementation();
+
+#endif /* __CRC32_H__ */
@@ -1,7 +1,26 @@
 //  Copyright (c) 2009 David Caldwell,  All Rights Reserved.
 
+// dalloc memory comes out of an arena: a stack of chunks that get handed out with a bump pointer. dalloc_start() just
+// remembers where the pointer is and dalloc_free() rewinds back to it, dropping any chunks used since in one go.
+// Memory from elsewhere (dalloc_remember()) is tracked in a list (itself living in the arena) and free()d on the way.
+
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
 #include "dalloc.h"
 
+#define ALIGN 16 // Enough for anything we store. Each allocation is preceded by ALIGN bytes holding its size.
+#define CHUNK_SIZE 16384
+
+static inline size_t round_up(size_t size) { return (size + ALIGN - 1) & ~(size_t)(ALIGN - 1); }
+
+struct dalloc_chunk {
+    struct dalloc_chunk *prev;
+    char *end;
+    char data[] __attribute__((aligned(ALIGN)));
+};
+
 struct dalloc_memory {
     struct dalloc_memory *next;
     void *mem;
@@ -9,22 +28,111 @@ struct dalloc_memory {
 
 struct dalloc_head {
     struct dalloc_head *next;
+    struct dalloc_chunk *chunk; // Where the arena was when dalloc_start() was called
+    char *mark;
     struct dalloc_memory *list;
 };
 
-static struct dalloc_head *dalloc_head_list;
+// Each thread gets its own arena, so nothing here needs locking.
+static __thread struct dalloc_head *dalloc_head_list;
+static __thread struct dalloc_chunk *chunk; // The current one
+static __thread char *next;                 // The free space in it
+static __thread struct dalloc_chunk *spare; // The last one dropped, so commands that fit in a chunk don't malloc at all
+
+static void drop_chunk();
+
+// A thread that goes away takes its chunks with it. The key's value doesn't matter, it just has to be non-NULL for
+// the destructor to get called.
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void free_arena(void *unused)
+{
+    while (chunk)
+        drop_chunk();
+    free(spare);
+    spare = NULL;
+    dalloc_head_list = NULL;
+}
+
+static void create_arena_key()
+{
+    pthread_key_create(&arena_key, free_arena);
+}
+
+static void new_chunk(size_t need)
+{
+    if (!chunk && !spare) { // This thread's first
+        pthread_once(&arena_key_once, create_arena_key);
+        pthread_setspecific(arena_key, &arena_key);
+    }
+    size_t size = need > CHUNK_SIZE - sizeof(struct dalloc_chunk) ? need + sizeof(struct dalloc_chunk) : CHUNK_SIZE;
+    struct dalloc_chunk *c;
+    if (spare && spare->end - spare->data >= size - sizeof(struct dalloc_chunk)) {
+        c = spare;
+        spare = NULL;
+    } else {
+        c = xmalloc(size);
+        c->end = (char *)c + size;
+    }
+    c->prev = chunk;
+    chunk = c;
+    next = c->data;
+}
+
+static void drop_chunk()
+{
+    struct dalloc_chunk *c = chunk;
+    chunk = c->prev;
+    if (spare && spare->end - spare->data >= c->end - c->data)
+        free(c);
+    else {
+        free(spare);
+        spare = c;
+    }
+}
+
+void *dalloc(size_t size)
+{
+    size_t need = ALIGN + round_up(size);
+    if (!chunk || chunk->end - next < need)
+        new_chunk(need);
+    char *p = next;
+    next += need;
+    *(size_t *)p = size;
+    return p + ALIGN;
+}
+
+void *dcalloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        errx(1, "Allocation of %zu * %zu bytes is too big", count, size);
+    return memset(dalloc(count * size), 0, count * size);
+}
+
+char *dstrdup(char *s)
+{
+    return dmemdup(s, strlen(s) + 1);
+}
+
+void *dmemdup(void *mem, size_t size)
+{
+    return memcpy(dalloc(size), mem, size);
+}
 
 void dalloc_start()
 {
-    struct dalloc_head *head = xcalloc(1, sizeof(*head));
-    head->next = dalloc_head_list;
+    struct dalloc_chunk *c = chunk;
+    char *mark = next;
+    struct dalloc_head *head = dalloc(sizeof(*head));
+    *head = (struct dalloc_head) { .next = dalloc_head_list, .chunk = c, .mark = mark };
     dalloc_head_list = head;
 }
 
 void *dalloc_remember(void *mem)
 {
     if (!mem) return mem;
-    struct dalloc_memory *m = xmalloc(sizeof(*m));
+    struct dalloc_memory *m = dalloc(sizeof(*m));
     m->mem = mem;
     m->next = dalloc_head_list->list;
     dalloc_head_list->list = m;
@@ -33,32 +141,46 @@ void *dalloc_remember(void *mem)
 
 void dalloc_free()
 {
-    struct dalloc_head *head = dalloc_head_list;
-    dalloc_head_list = dalloc_head_list->next;
-    for (struct dalloc_memory *m=head->list, *next; m; m=next) {
-        next = m->next;
+    struct dalloc_head head = *dalloc_head_list;
+    for (struct dalloc_memory *m=head.list; m; m=m->next)
         free(m->mem);
-        free(m);
-    }
-    free(head);
+    dalloc_head_list = head.next;
+    while (chunk != head.chunk)
+        drop_chunk();
+    next = head.mark;
 }
 
-
 void *drealloc(void *old, size_t count)
 {
-    for (struct dalloc_memory *m=dalloc_head_list->list; m; m=m->next)
-        if (m->mem == old) m->mem = NULL; // Taking it out of the list is hard. Let's go shopping.
-    return dalloc_remember(xrealloc(old,count));
+    if (!old) return dalloc(count);
+    char *p = (char *)old - ALIGN;
+    size_t size = *(size_t *)p;
+    // The most recent allocation can usually just grow (or shrink) where it is.
+    if (p + ALIGN + round_up(size) == next && chunk->end - p >= ALIGN + round_up(count)) {
+        next = p + ALIGN + round_up(count);
+        *(size_t *)p = count;
+        return old;
+    }
+    return memcpy(dalloc(count), old, size < count ? size : count);
 }
 
 #include <stdarg.h>
 #include <stdio.h>
 char *dsprintf(char *format, ...)
 {
-    char *out;
-    va_list ap;
+    va_list ap, again;
     va_start(ap, format);
-    vxsprintf(&out, format, ap);
+    va_copy(again, ap);
+    // Try formatting straight into the free end of the current chunk. If it fits, claiming the space with dalloc()
+    // gives back that same spot. If not, we know the exact size to ask for.
+    size_t room = chunk && chunk->end - next > ALIGN ? chunk->end - next - ALIGN : 0;
+    int length = vsnprintf(room ? next + ALIGN : NULL, room, format, ap);
+    if (length < 0)
+        err(1, "Couldn't format \"%s\"", format);
+    char *out = dalloc(length + 1);
+    if (length + 1 > room)
+        vsnprintf(out, length + 1, format, again);
+    va_end(again);
     va_end(ap);
-    return dalloc_remember(out);
+    return out;
 }
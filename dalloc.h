@@ -4,14 +4,15 @@
 
 #include "xmem.h"
 
+// Memory that lasts until the matching dalloc_free(). Calls nest.
 void dalloc_start();
-void *dalloc_remember(void *mem);
 void dalloc_free();
-static inline void *dalloc(size_t size)                { return dalloc_remember(xmalloc(size)); }
-static inline void *dcalloc(size_t count, size_t size) { return dalloc_remember(xcalloc(count, size)); }
-static inline char *dstrdup(char *s)                   { return dalloc_remember(xstrdup(s)); }
-static inline void *dmemdup(void *mem, size_t size)    { return dalloc_remember(xmemdup(mem, size)); }
-void *drealloc(void *old, size_t count);
+void *dalloc(size_t size);
+void *dcalloc(size_t count, size_t size);
+char *dstrdup(char *s);
+void *dmemdup(void *mem, size_t size);
+void *drealloc(void *old, size_t count); // old has to come from one of the above (or be NULL)
+void *dalloc_remember(void *mem); // Hands memory from malloc() over to be free()d by dalloc_free()
 char *dsprintf(char *format, ...) __attribute__ ((format (printf, 1, 2)));
 
 #endif /* __DALLOC_H__ */
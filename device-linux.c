@@ -5,8 +5,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <err.h>
 #include "xmem.h"
 #include "device.h"
@@ -50,6 +55,277 @@ struct device *open_disk_device(char *name)
     return xmemdup(&dev, sizeof(dev));
 }
 
+// Reads a number out of a sysfs attribute file. 0 if it's not there.
+static unsigned long sysfs_value(const char *dir, const char *attr)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    unsigned long value = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%lu", &value) != 1)
+            value = 0;
+        fclose(f);
+    }
+    return value;
+}
+
+// Fills in whatever the ioctls didn't from the block device's sysfs directory.
+static void sysfs_topology(struct device *dev, const char *dir)
+{
+    // Partitions don't have their own queue directory--their disk's is one level up.
+    char queue[PATH_MAX];
+    snprintf(queue, sizeof(queue), "%s/queue", dir);
+    if (access(queue, F_OK) != 0)
+        snprintf(queue, sizeof(queue), "%s/../queue", dir);
+    if (!dev->physical_block_size) dev->physical_block_size = sysfs_value(queue, "physical_block_size");
+    if (!dev->io_min)              dev->io_min              = sysfs_value(queue, "minimum_io_size");
+    if (!dev->io_opt)              dev->io_opt              = sysfs_value(queue, "optimal_io_size");
+    if (!dev->alignment_offset)    dev->alignment_offset    = sysfs_value(dir,   "alignment_offset");
+}
+
+// An image file only has a real layout if it's attached to a loop device, in which case the loop device's limits (from
+// losetup --sector-size, or inherited from the disk underneath) are how it's going to get used.
+static bool find_loop_device(struct stat *file, char *dir, size_t dir_size)
+{
+    DIR *block = opendir("/sys/block");
+    if (!block) return false;
+    bool found = false;
+    for (struct dirent *e; !found && (e = readdir(block)); ) {
+        if (strncmp(e->d_name, "loop", 4) != 0)
+            continue;
+        char path[PATH_MAX], backing[PATH_MAX];
+        snprintf(path, sizeof(path), "/sys/block/%s/loop/backing_file", e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        bool read = fgets(backing, sizeof(backing), f) != NULL;
+        fclose(f);
+        backing[strcspn(backing, "\n")] = '\0';
+        struct stat st;
+        if (read && stat(backing, &st) == 0 && st.st_dev == file->st_dev && st.st_ino == file->st_ino) {
+            snprintf(dir, dir_size, "/sys/block/%s", e->d_name);
+            found = true;
+        }
+    }
+    closedir(block);
+    return found;
+}
+
+void device_topology(struct device *dev)
+{
+    struct stat st;
+    if (fstat(dev->fd, &st) == -1)
+        return;
+    char dir[PATH_MAX];
+    if (S_ISBLK(st.st_mode)) {
+        unsigned int value;
+        int offset;
+        if (ioctl(dev->fd, BLKPBSZGET, &value) == 0) dev->physical_block_size = value;
+        if (ioctl(dev->fd, BLKIOMIN,   &value) == 0) dev->io_min              = value;
+        if (ioctl(dev->fd, BLKIOOPT,   &value) == 0) dev->io_opt              = value;
+        if (ioctl(dev->fd, BLKALIGNOFF, &offset) == 0 && offset > 0) dev->alignment_offset = offset; // -1 means hopeless
+        snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    } else if (!S_ISREG(st.st_mode) || !find_loop_device(&st, dir, sizeof(dir)))
+        return;
+    sysfs_topology(dev, dir);
+}
+
+// io_uring backend. This talks to the kernel directly rather than pulling in liburing, since all we need is to get a
+// handful of reads (or writes) in flight together and wait for them.
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 16
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+struct uring_op {
+    int opcode;
+    const void *addr; // iovec array (or NULL for fsync)
+    unsigned len;     // number of iovecs
+    unsigned long long offset;
+    size_t expect;    // bytes we expect to have transferred
+};
+
+static void uring_free(struct uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)         munmap(r->sqes, r->entries * sizeof(*r->sqes));
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)   munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+static bool uring_open(struct device *dev)
+{
+    struct io_uring_params p = {};
+    struct uring *r = xcalloc(1, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0)
+        goto fail;
+    r->entries = p.sq_entries;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_ring_size = r->cq_ring_size = r->sq_ring_size > r->cq_ring_size ? r->sq_ring_size : r->cq_ring_size;
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) goto fail;
+    r->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_ring
+               : mmap(NULL, r->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) goto fail;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(*r->sqes), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    r->sq_head  = r->sq_ring + p.sq_off.head;
+    r->sq_tail  = r->sq_ring + p.sq_off.tail;
+    r->sq_mask  = r->sq_ring + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ring + p.sq_off.array;
+    r->cq_head  = r->cq_ring + p.cq_off.head;
+    r->cq_tail  = r->cq_ring + p.cq_off.tail;
+    r->cq_mask  = r->cq_ring + p.cq_off.ring_mask;
+    r->cqes     = r->cq_ring + p.cq_off.cqes;
+
+    dev->backend_data = r;
+    return true;
+
+  fail:;
+    int error = errno;
+    uring_free(r);
+    errno = error;
+    return false;
+}
+
+static void uring_close(struct device *dev)
+{
+    uring_free(dev->backend_data);
+    dev->backend_data = NULL;
+}
+
+// Collects the completions that are ready, noting any failure in |error|. Returns how many there were.
+static int uring_reap(struct uring *r, struct uring_op *op, int *error)
+{
+    int reaped = 0;
+    unsigned head = *r->cq_head;
+    for (; head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE); head++, reaped++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        if (cqe->res < 0)
+            *error = -cqe->res;
+        else if (cqe->res != op[cqe->user_data].expect)
+            *error = EIO;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Cleans up after io_uring_enter() fails part way through a batch. The ops point at the caller's iovecs and buffers,
+// which go away as soon as we return, so none can be left behind: take back the ones the kernel hasn't picked up and
+// wait for the rest to finish. If even waiting fails, give up on the ring and do the device's I/O synchronously.
+static void uring_abandon(struct device *dev, struct uring_op *op, int pending)
+{
+    struct uring *r = dev->backend_data;
+    unsigned tail = *r->sq_tail, head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+    pending -= tail - head;
+
+    int ignored;
+    while ((pending -= uring_reap(r, op, &ignored)) > 0)
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            warn("Couldn't wait for I/O on %s. Switching to the %s backend", dev->name, sync_backend.name);
+            uring_close(dev); // Closing the ring cancels what's still in it
+            dev->backend = &sync_backend;
+            return;
+        }
+}
+
+// Submits all the ops (in chunks of as many as the ring holds) and waits for every one of them to complete.
+static bool uring_run(struct device *dev, struct uring_op *op, int count)
+{
+    struct uring *r = dev->backend_data;
+    int error = 0;
+    for (int done=0; done < count; ) {
+        int batch = count - done < r->entries ? count - done : r->entries;
+        unsigned tail = *r->sq_tail;
+        for (int i=0; i<batch; i++, tail++) {
+            unsigned index = tail & *r->sq_mask;
+            r->sqes[index] = (struct io_uring_sqe) {
+                .opcode    = op[done+i].opcode,
+                .fd        = dev->fd,
+                .addr      = (uintptr_t)op[done+i].addr,
+                .len       = op[done+i].len,
+                .off       = op[done+i].offset,
+                .user_data = done+i,
+            };
+            r->sq_array[index] = index;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        for (int submit = batch, pending = batch; pending; ) {
+            int submitted = syscall(__NR_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (submitted < 0) {
+                if (errno == EINTR) continue;
+                int enter_error = errno;
+                uring_abandon(dev, op, pending);
+                errno = enter_error;
+                return false;
+            }
+            submit -= submitted;
+            pending -= uring_reap(r, op, &error);
+        }
+        done += batch;
+    }
+    errno = error;
+    return !error;
+}
+
+static bool uring_read(struct device *dev, struct device_io *io, int count)
+{
+    struct iovec iov[count];
+    struct uring_op op[count];
+    for (int i=0; i<count; i++) {
+        iov[i] = (struct iovec) { .iov_base = io[i].buffer, .iov_len = io[i].sectors * dev->sector_size };
+        op[i] = (struct uring_op) { .opcode = IORING_OP_READV, .addr = &iov[i], .len = 1,
+                                    .offset = io[i].sector * dev->sector_size, .expect = iov[i].iov_len };
+    }
+    return uring_run(dev, op, count);
+}
+
+static bool uring_writev(struct device *dev, const struct iovec *vec, int count, unsigned long long sector)
+{
+    struct uring_op op = { .opcode = IORING_OP_WRITEV, .addr = vec, .len = count, .offset = sector * dev->sector_size };
+    for (int i=0; i<count; i++)
+        op.expect += vec[i].iov_len;
+    return uring_run(dev, &op, 1);
+}
+
+static bool uring_flush(struct device *dev)
+{
+    return uring_run(dev, &(struct uring_op) { .opcode = IORING_OP_FSYNC }, 1);
+}
+
+static const struct device_backend uring_backend = {
+    .name   = "io_uring",
+    .open   = uring_open,
+    .close  = uring_close,
+    .read   = uring_read,
+    .writev = uring_writev,
+    .flush  = uring_flush,
+};
+
+const struct device_backend *device_backends[] = { &uring_backend, &sync_backend, NULL };
+
 char *device_help()
 {
     return "  <device> is /dev/sd* style device (full path)\n";
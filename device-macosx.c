@@ -46,6 +46,15 @@ struct device *open_disk_device(char *name)
     return xmemdup(&dev, sizeof(dev));
 }
 
+void device_topology(struct device *dev)
+{
+    uint32_t size;
+    if (ioctl(dev->fd, DKIOCGETPHYSICALBLOCKSIZE, &size) != -1)
+        dev->physical_block_size = size;
+}
+
+const struct device_backend *device_backends[] = { &sync_backend, NULL };
+
 char *device_help()
 {
     return "  <device> is /dev/disk* style device (full path)\n";
@@ -5,22 +5,49 @@
 #include <err.h>
 #include "device.h"
 
+#include <string.h>
+#include <unistd.h>
 void *alloc_sectors(struct device *dev, unsigned long sectors)
 {
-    char *data = calloc(sectors, dev->sector_size);
-    if (!data)
-        err(0, "Couldn't allocate memory for %ld sectors (%ld bytes)", sectors, dev->sector_size * sectors);
+    // Direct I/O needs buffers aligned to the sector size. Page alignment covers every device that's likely to show up.
+    size_t alignment = dev->sector_size > getpagesize() ? dev->sector_size : getpagesize();
+    void *data;
+    if (posix_memalign(&data, alignment, sectors * dev->sector_size))
+        err(1, "Couldn't allocate memory for %ld sectors (%ld bytes)", sectors, dev->sector_size * sectors);
+    memset(data, 0, sectors * dev->sector_size);
     return data;
 }
 
 void *get_sectors(struct device *dev, unsigned long long sector_num, unsigned long sectors)
 {
     void *data = alloc_sectors(dev, sectors);
-    if (!device_read(dev, data, sector_num, sectors))
-        err(errno, "Couldn't read sectors %ld through %ld", sector_num, sector_num+sectors);
+    if (!device_read(dev, data, sector_num, sectors)) {
+        int error = errno;
+        warn("Couldn't read sectors %llu through %llu", sector_num, sector_num+sectors);
+        free(data);
+        errno = error;
+        return NULL;
+    }
     return data;
 }
 
+bool get_sectors_batch(struct device *dev, struct device_io *io, int count)
+{
+    for (int i=0; i<count; i++)
+        io[i].buffer = alloc_sectors(dev, io[i].sectors);
+    if (!device_read_batch(dev, io, count)) {
+        int error = errno;
+        warn("Couldn't read sectors %llu through %llu (and %d others)", io[0].sector, io[0].sector+io[0].sectors, count-1);
+        for (int i=0; i<count; i++) {
+            free(io[i].buffer);
+            io[i].buffer = NULL;
+        }
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -36,12 +63,19 @@ static struct device *open_file_device(char *name)
     if (sector_size_str)  sector_size  = strtoull(sector_size_str, NULL, 0);
 
     int fd = open(filename, O_RDWR);
-    if (fd < 0)
-        err(errno, "Error opening %s", filename);
+    if (fd < 0) {
+        warn("Error opening %s", filename);
+        return NULL;
+    }
     if (!sector_count) {
         struct stat st;
-        if (fstat(fd, &st) == -1)
-            err(errno, "can't find file size");
+        if (fstat(fd, &st) == -1) {
+            int error = errno;
+            warn("can't find file size");
+            close(fd);
+            errno = error;
+            return NULL;
+        }
         sector_count = st.st_size/sector_size;
     }
     struct device dev = {
@@ -53,31 +87,144 @@ static struct device *open_file_device(char *name)
     return xmemdup(&dev, sizeof(dev));
 }
 
-struct device *open_device(char *name)
+// O_DIRECT on Linux, F_NOCACHE on OS X.
+static bool set_direct_io(int fd)
+{
+#if defined(O_DIRECT)
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) != -1;
+#elif defined(F_NOCACHE)
+    return fcntl(fd, F_NOCACHE, 1) != -1;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+static bool open_backend(struct device *dev, char *name)
+{
+    for (const struct device_backend **b = device_backends; *b; b++) {
+        if (name && strcmp(name, (*b)->name) != 0)
+            continue;
+        if (!(*b)->open || (*b)->open(dev)) {
+            dev->backend = *b;
+            return true;
+        }
+        if (name) {
+            warn("Couldn't use the %s backend on %s", name, dev->name);
+            return false;
+        }
+    }
+    if (name) {
+        warnx("No such I/O backend: \"%s\"", name);
+        errno = EINVAL;
+        return false;
+    }
+    dev->backend = &sync_backend;
+    return true;
+}
+
+struct device *open_device(char *name, bool direct_io, char *backend)
 {
     struct device *dev = open_disk_device(name);
     if (!dev || dev->sector_size == 0 || dev->sector_count == 0) {
         close_device(dev);
         dev = open_file_device(name);
     }
+    if (dev) {
+        device_topology(dev);
+        if (dev->physical_block_size < dev->sector_size || dev->physical_block_size % dev->sector_size)
+            dev->physical_block_size = dev->sector_size;
+        if (dev->io_min < dev->physical_block_size)
+            dev->io_min = dev->physical_block_size;
+        dev->alignment_offset %= dev->physical_block_size;
+    }
+    if (dev && direct_io) {
+        dev->direct_io = set_direct_io(dev->fd);
+        if (!dev->direct_io)
+            warn("Couldn't enable direct I/O on %s. Using the page cache instead", dev->name);
+    }
+    if (dev && !open_backend(dev, backend)) {
+        close_device(dev);
+        return NULL;
+    }
     return dev;
 }
 
+bool device_lbas_aligned(struct device *dev, unsigned long long first_lba, unsigned long long last_lba)
+{
+    unsigned long long pbs = dev->physical_block_size,
+                       skew = pbs - dev->alignment_offset;
+    return (first_lba    * dev->sector_size + skew) % pbs == 0 &&
+           ((last_lba+1) * dev->sector_size + skew) % pbs == 0;
+}
+
 void close_device(struct device *dev)
 {
     if (!dev) return;
+    if (dev->backend && dev->backend->close)
+        dev->backend->close(dev);
     close(dev->fd);
     free(dev->name);
     free(dev);
 }
 
-#include <stdio.h>
 bool device_read(struct device *dev, void *buffer, unsigned long long sector, unsigned long sectors)
 {
-    return pread(dev->fd, buffer, dev->sector_size * sectors, dev->sector_size * sector) == dev->sector_size * sectors;
+    return dev->backend->read(dev, &(struct device_io) { .buffer = buffer, .sector = sector, .sectors = sectors }, 1);
+}
+
+bool device_read_batch(struct device *dev, struct device_io *io, int count)
+{
+    return dev->backend->read(dev, io, count);
 }
 
 bool device_write(struct device *dev, void *buffer, unsigned long long sector, unsigned long sectors)
 {
-    return pwrite(dev->fd, buffer, dev->sector_size * sectors, dev->sector_size * sector) == dev->sector_size * sectors;
+    return dev->backend->writev(dev, &(struct iovec) { .iov_base = buffer, .iov_len = dev->sector_size * sectors }, 1, sector);
+}
+
+bool device_writev(struct device *dev, const struct iovec *vec, int count, unsigned long long sector)
+{
+    return dev->backend->writev(dev, vec, count, sector);
+}
+
+bool device_flush(struct device *dev)
+{
+    return dev->backend->flush(dev);
 }
+
+static bool sync_read(struct device *dev, struct device_io *io, int count)
+{
+    for (int i=0; i<count; i++) {
+        ssize_t got = pread(dev->fd, io[i].buffer, dev->sector_size * io[i].sectors, dev->sector_size * io[i].sector);
+        if (got != dev->sector_size * io[i].sectors) {
+            if (got >= 0) errno = EIO; // Short: it ran off the end of the device
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sync_writev(struct device *dev, const struct iovec *vec, int count, unsigned long long sector)
+{
+    size_t length = 0;
+    for (int i=0; i<count; i++)
+        length += vec[i].iov_len;
+    ssize_t wrote = pwritev(dev->fd, vec, count, dev->sector_size * sector);
+    if (wrote >= 0 && wrote != length)
+        errno = EIO; // Short: it ran off the end of the device
+    return wrote == length;
+}
+
+static bool sync_flush(struct device *dev)
+{
+    return fsync(dev->fd) == 0;
+}
+
+const struct device_backend sync_backend = {
+    .name   = "sync",
+    .read   = sync_read,
+    .writev = sync_writev,
+    .flush  = sync_flush,
+};
@@ -3,26 +3,63 @@
 #define __DEVICE_H__
 
 #include <stdbool.h>
+#include <sys/uio.h>
+
+struct device_backend;
 
 struct device {
     char *name;
     unsigned long sector_size;
     unsigned long long sector_count;
+    // How the device is really laid out underneath its logical sectors, all in bytes:
+    unsigned long physical_block_size; // Writes smaller than this mean a read-modify-write. Never less than sector_size.
+    unsigned long io_min;              // Smallest efficient I/O (a RAID chunk, say). Never less than physical_block_size.
+    unsigned long io_opt;              // Preferred I/O size (a RAID stripe, say). 0 if the device doesn't say.
+    unsigned long alignment_offset;    // Where the first whole physical block starts, relative to LBA 0.
     int fd;
+    bool direct_io; // Bypassing the page cache. Every buffer handed to the device must come from alloc_sectors().
+    const struct device_backend *backend;
+    void *backend_data;
+};
+
+// One request in a batch of reads
+struct device_io {
+    void *buffer;
+    unsigned long long sector;
+    unsigned long sectors;
+};
+
+// How I/O actually gets to the device. The synchronous pread()/pwrite() backend works everywhere. Others (io_uring on
+// Linux) can get a whole batch of requests in flight at once.
+struct device_backend {
+    char *name;
+    bool (*open)(struct device *dev); // false if the backend can't be used here
+    void (*close)(struct device *dev);
+    bool (*read)(struct device *dev, struct device_io *io, int count);
+    bool (*writev)(struct device *dev, const struct iovec *vec, int count, unsigned long long sector);
+    bool (*flush)(struct device *dev);
 };
 
-void *alloc_sectors(struct device *dev, unsigned long sectors);
-void *get_sectors(struct device *dev, unsigned long long sector_num, unsigned long sectors);
+void *alloc_sectors(struct device *dev, unsigned long sectors); // Zeroed and suitably aligned for the device
+void *get_sectors(struct device *dev, unsigned long long sector_num, unsigned long sectors); // NULL (after complaining) if the read fails
+bool get_sectors_batch(struct device *dev, struct device_io *io, int count); // Fills in each io's buffer. false if any read fails
 
 // device specific:
-struct device *open_device(char *name);
+struct device *open_device(char *name, bool direct_io, char *backend); // NULL backend picks the best one available. NULL if it can't be opened
 void close_device(struct device *dev);
 bool device_read(struct device *dev, void *buffer, unsigned long long sector, unsigned long sectors);
+bool device_read_batch(struct device *dev, struct device_io *io, int count);
 bool device_write(struct device *dev, void *buffer, unsigned long long sector, unsigned long sectors);
+bool device_writev(struct device *dev, const struct iovec *vec, int count, unsigned long long sector); // iov_len must be whole sectors
+bool device_flush(struct device *dev);
 char *device_help();
+bool device_lbas_aligned(struct device *dev, unsigned long long first_lba, unsigned long long last_lba); // On physical block boundaries?
 
 // Backend use only:
 struct device *open_disk_device(char *name);
+void device_topology(struct device *dev); // Fills in whatever it can of physical_block_size, io_min, io_opt, alignment_offset
+extern const struct device_backend sync_backend;
+extern const struct device_backend *device_backends[]; // Platform specific, in order of preference. NULL terminated.
 
 #endif /* __DEVICE_H__ */
 
@@ -10,8 +10,15 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <sys/param.h> // PATH_MAX on both linux and OS X
-#include <sys/stat.h>  // mkdir
+#include <sys/stat.h>  // lstat
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
 #include <err.h>
+#include <getopt.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "lengthof.h"
@@ -21,63 +28,77 @@
 #include "device.h"
 #include "gpt.h"
 #include "mbr.h"
-#include "autolist.h"
-#include "csprintf.h"
 #include "human.h"
 #include "xmem.h"
 #include "dalloc.h"
 #include "gdisk.h"
 
-autolist_define(command);
-
-static int run_command(char *line, char **final_line);
-static struct partition_table read_table(struct device *dev);
-static void free_table(struct partition_table t);
 static char *command_completion(const char *text, int state);
 static char *partition_type_completion(const char *text, int state);
 static char *partition_size_completion(const char *text, int state);
-struct free_space {
-    uint64_t first_lba;
-    uint64_t blocks;
-};
-static struct free_space *find_free_spaces(struct partition_table unsorted);
-static struct free_space largest_free_space(struct partition_table unsorted);
-static bool table_is_dirty(struct partition_table t);
-static void dump_dev(struct device *dev);
-static void dump_header(struct gpt_header *header);
-static void dump_partition(struct gpt_partition *p);
-static size_t sncatprintf(char *buffer, size_t space, char *format, ...) __attribute__ ((format (printf, 3, 4)));
-static char *tr(char *in, char *from, char *to);
-static char *trdup(char *in, char *from, char *to);
-static char *ctr(char *in, char *from, char *to);
-static char *trim(char *s);
 
 static void usage(char *me, int exit_code)
 {
     fprintf(exit_code ? stderr : stdout,
             "Usage: \n"
-            "   %s <device>\n"
-            "%s", me, device_help());
+            "   %s [<options>] [--script <file>] <device>\n"
+            "   %s [<options>] --script <file> [--jobs <n>] <device> [<device> ...]\n"
+            "   %s [<options>] --serve <path>\n"
+            "%s"
+            "  --script <file> runs the commands in <file> (\"-\" for stdin) without prompting\n"
+            "                  and stops at the first one that fails.\n"
+            "  --jobs <n>      applies the script to at most <n> devices at once (default: one per CPU).\n"
+            "  --serve <path>  runs commands sent to the Unix domain socket <path>, keeping devices open between\n"
+            "                  them. Send \"device <name>\" to pick a device, then commands, one per line. Each\n"
+            "                  response is the output, a NUL, then the command's status and a newline. Every\n"
+            "                  device has its own process, so a slow command on one doesn't hold up the others.\n"
+            "  --direct        bypasses the page cache (O_DIRECT) when reading and writing devices.\n"
+            "  --io <backend>  chooses how I/O is done: \"sync\" or (on Linux) \"io_uring\". The default is the\n"
+            "                  fastest one that works.\n"
+            "  --fit <policy>  where \"new\" puts partitions by default: in the \"first\" free space they fit in,\n"
+            "                  the \"best\" (smallest) or \"worst\" (biggest) fitting one, or at the \"end\" of the disk.\n"
+            "  --align <size>  what \"new\" aligns the start of partitions to by default (default: 1M). \"physical\" and\n"
+            "                  \"optimal\" use the device's physical block size or optimal I/O size.\n"
+            "  --types <file>  adds the partition types listed in <file> (default: ~/.gdisk/partition-types, if it\n"
+            "                  exists). Each line is \"<guid> <mbr types, comma separated hex, or -> <name>\".\n", me, me, me, device_help());
     exit(exit_code);
 }
 
-struct partition_table g_table;
+static bool direct_io = false;
+static char *io_backend = NULL;
 
-int main(int c, char **v)
+// Defaults for the new command's --fit and --align. They go in each table's settings.
+static enum fit default_fit = Fit_First;
+static char *default_align = "1M";
+
+// Readline's completion callbacks don't take a context pointer, so they get the table from here.
+static struct partition_table *completion_table;
+
+// Asks for missing arguments. Scripts and --serve have nobody to answer, so they don't pass this to run_command() and
+// missing arguments are errors instead.
+static char *prompt_argument(struct command *c, struct command_arg_ *arg)
 {
-    char *device_name = v[1];
-    if (!device_name)
-        usage(v[0], 1);
+    char *prompt = dsprintf("%s: Enter %s: ", c->name, arg->help);
 
-    struct device *dev = open_device(device_name);
-    if (!dev)
-        err(0, "Couldn't find device %s", v[1]);
-    if (dev->sector_size < 512)
-        err(0, "Disk has a sector size of %lu which is not big enough to support an MBR which I don't support yet.", dev->sector_size);
-    g_table = read_table(dev);
+    if (C_Type(arg->type) == C_File)
+        rl_completion_entry_function = (void*)rl_filename_completion_function;
+    else if (C_Type(arg->type) == C_Partition_Type)
+        #warning "BUG: partition type completion doesn't do spaces right"
+        rl_completion_entry_function = (void*)partition_type_completion;
+    else if (C_Type(arg->type) == C_FreeSpace)
+        rl_completion_entry_function = (void*)partition_size_completion;
+    // rl_completer_quote_characters = "\"'";
+    // rl_basic_word_break_characters = "";
+    rl_completion_append_character = '\0';
+
+    return readline(prompt);
+}
 
+static int run_interactive(struct partition_table *t)
+{
     char *line, *final_line;
     int status = 0;
+    completion_table = t;
     do {
         rl_completion_entry_function = (void*)command_completion; // rl_completion_entry_function is defined to return an int??
         rl_completion_append_character = ' ';
@@ -86,1632 +107,688 @@ int main(int c, char **v)
             printf("\n");
             break;
         }
-        status = run_command(line, &final_line);
+        status = run_command(t, line, &final_line, prompt_argument);
         add_history(final_line);
         free(line);
         free(final_line);
     } while (status != ECANCELED); // Special case meaning Quit!
-    if (table_is_dirty(g_table))
-        printf("Quitting without saving changes.\n");
-
-    free_table(g_table);
-
-    //if (!write_mbr(dev, mbr))
-    //    warn("Couldn't write MBR sector");
+    completion_table = NULL;
+    return 0;
 }
 
-char *next_word(char **line)
+static char *load_script(char *script_name)
 {
-    if (!*line) return NULL;
-    if (**line == '"') {
-        char *s = ++*line; // skip quote
-        while (**line != '"' && **line != '\0')
-            ++*line;
-        if (**line)
-            *(*line)++ = '\0';
-        if (**line == '\0')
-            *line = NULL;
-        return s;
+    FILE *file = strcmp(script_name, "-") == 0 ? stdin : fopen(script_name, "r");
+    if (!file) {
+        warn("Couldn't open script %s", script_name);
+        return NULL;
     }
-    return strsep(line, " \t\f\r\n");
+    char *script = NULL;
+    size_t length = 0;
+    for (size_t got; script = xrealloc(script, length + BUFSIZ + 1), (got = fread(script + length, 1, BUFSIZ, file)); length += got) {}
+    script[length] = '\0';
+    if (file != stdin)
+        fclose(file);
+    return script;
 }
 
-static char **parse_command(char *line)
+static int run_script(struct partition_table *t, char *script_name, char *script)
 {
-    char **v = dcalloc(1, sizeof(char*));
-    int c = 0;
-
-    char *rest = line;
-    char *word;
-    while (word = next_word(&rest)) {
-        if (!*word) continue; // compact multiple consecutive separators
-        v = drealloc(v, sizeof(char *) * (c+2));
-        v[c] = word;
-        v[c+1] = NULL;
-        c++;
+    char *rest = xstrdup(script), *lines = rest, *line;
+    int status = 0;
+    for (int line_number=1; (line = strsep(&rest, "\n")); line_number++) {
+        if (*trim(line) == '#') continue;
+        status = run_command(t, line, NULL, NULL);
+        if (status == ECANCELED) { // quit
+            status = 0;
+            break;
+        }
+        if (status) {
+            fprintf(stderr, "%s:%d: Command failed (%d). Stopping.\n", script_name, line_number, status);
+            break;
+        }
     }
-    return v;
-}
-
-static struct command *find_command(char *command)
-{
-    foreach_autolist(struct command *c, command)
-        if (strcmp(command, c->name) == 0)
-            return c;
-    return NULL;
+    free(lines);
+    return status;
 }
 
-static int run_command(char *line, char **final_line)
+static int process_device(char *device_name, char *script_name, char *script)
 {
-    if (final_line) *final_line = xstrdup(line);
-    dalloc_start();
-    int status = 0;
-    char **cmdv = NULL;
-    char **argv = parse_command(line);
-    int argc;
-    for (argc=0; argv[argc]; argc++) {}
-    if (!argc) goto done; // Blank line
+    struct partition_table table;
+    int status = open_table(device_name, direct_io, io_backend, &table);
+    if (status)
+        return status;
+    struct device *dev = table.dev;
+    table.settings = (struct settings) { .fit = default_fit, .align = default_align };
 
-    for (char **v = argv; *v; v++)
-        if (strchr(*v, '"')) {
-            fprintf(stderr, "Sorry, embedded quotes don't work (yet?). If you are trying to do\n"
-                    "'--arg=\"a b\"' then do '--arg \"a b\"' or '\"--arg=a b\"' instead.\n"
-                    "Yeah, that sucks. Send me a patch if it bugs you that much.\n");
-            status = EINVAL;
-            goto done;
-        }
+    status = script ? run_script(&table, script_name, script) : run_interactive(&table);
 
-    struct command *c = find_command(argv[0]);
-    if (!c) {
-        printf("Command not found: '%s'\n", argv[0]);
-        status = EINVAL;
-        goto done;
-    }
+    if (table_is_dirty(&table))
+        printf("%s: Quitting without saving changes.\n", dev->name);
 
-    int args;
-    for (args=0; c->arg[args].name; args++) {}
+    free_table(&table);
+    close_device(dev);
+    return status;
+}
 
-    cmdv = dcalloc(1+args+1, sizeof(*argv));
-    cmdv[0] = argv[0];
-    for (int i=1; i<argc; i++) {
-        if (argv[i][0] == '-') {
-            char *rest = argv[i];
-            char *name = strsep(&rest, "=");
-            while (*name == '-') name++;
-            for (int a=0; a<args; a++)
-                if (strcmp(c->arg[a].name, name) == 0) {
-                    char **arg = &cmdv[a+1];
-                    if (c->arg[a].type == C_Flag)
-                        *arg = argv[i];
-                    else if (!rest  || !*rest)
-                        if (i+1 >= argc) {
-                            fprintf(stderr, "Missing parameter for argument \"%s\"\n", name);
-                            status = EINVAL;
-                            goto done;
-                        } else
-                            *arg = argv[++i];
-                    else
-                        *arg = rest;
-                    goto found;
+// Prints what a worker wrote to |output|, under the name of its device.
+static void print_output(char *name, FILE *output)
+{
+    rewind(output);
+    char chunk[BUFSIZ];
+    for (size_t got, total = 0; (got = fread(chunk, 1, sizeof(chunk), output)); total += got) {
+        if (!total)
+            printf("==> %s <==\n", name);
+        fwrite(chunk, 1, got, stdout);
+    }
+    fflush(stdout);
+}
+
+// Each device gets its own worker process, with at most |jobs| of them running at once. They're processes and not
+// threads because commands print to stdout and stderr, and this way each worker can have its own. Those go to a scratch
+// file that gets printed in one piece when the worker is done, so output from different devices never gets mixed up.
+static int process_devices(char **device_name, int devices, int jobs, char *script_name, char *script)
+{
+    pid_t worker[devices];
+    FILE *output[devices];
+    int running = 0, failed = 0;
+    for (int next = 0; next < devices || running; ) {
+        if (next < devices && running < jobs) {
+            pid_t pid = -1;
+            if (!(output[next] = tmpfile()))
+                warn("Couldn't create a file for %s's output", device_name[next]);
+            else {
+                fflush(stdout);
+                fflush(stderr);
+                pid = fork();
+                if (pid == 0) {
+                    dup2(fileno(output[next]), 1);
+                    dup2(fileno(output[next]), 2);
+                    setvbuf(stdout, NULL, _IOLBF, 0); // Keep stdout and stderr in the order they were printed.
+                    exit(process_device(device_name[next], script_name, script));
                 }
-            fprintf(stderr, "Command \"%s\" has no such argument \"%s\". Try 'help %s'\n", c->name, name, c->name);
-            status = EINVAL;
-            goto done;
-        } else {
-            for (int o=1; o<args+1; o++)
-                if (!cmdv[o] && c->arg[o-1].type != C_Flag) {
-                    cmdv[o] = argv[i];
-                    goto found;
+                if (pid == -1) {
+                    warn("Couldn't start worker for %s", device_name[next]);
+                    fclose(output[next]);
                 }
-            fprintf(stderr, "Too many arguments for command '%s'\n", argv[0]);
-            status = EINVAL;
-            goto done;
-        }
-      found:;
-    }
-
-    char **v = cmdv + 1; // start past command name.
-    for (int a=0; a<args; a++, v++) {
-        if (*v) continue; // Don't prompt for args entered on command line.
-        if (c->arg[a].type & C_Optional)
+            }
+            if (pid == -1)
+                failed++;
+            else
+                running++;
+            worker[next++] = pid;
             continue;
-        char *prompt = dsprintf("%s: Enter %s: ", c->name, c->arg[a].help);
-        if (!prompt) err(ENOMEM, "No memory for argument prompt");
-
-        if (C_Type(c->arg[a].type) == C_File)
-            rl_completion_entry_function = (void*)rl_filename_completion_function;
-        else if (C_Type(c->arg[a].type) == C_Partition_Type)
-            #warning "BUG: partition type completion doesn't do spaces right"
-            rl_completion_entry_function = (void*)partition_type_completion;
-        else if (C_Type(c->arg[a].type) == C_FreeSpace)
-            rl_completion_entry_function = (void*)partition_size_completion;
-        // rl_completer_quote_characters = "\"'";
-        // rl_basic_word_break_characters = "";
-        rl_completion_append_character = '\0';
-
-        *v = dalloc_remember(readline(prompt));
-        if (!*v) goto done;
-        *v = trim(*v);
-
-        if (final_line) {
-            *final_line = xstrcat(*final_line, " ");
-            *final_line = xstrcat(*final_line, *v);
         }
-    }
-
-    status = c->handler(cmdv);
-
-  done:
-    dalloc_free();
-    return status;
-}
 
-static char *arg_name(struct command_arg_ *arg)
-{
-    return dsprintf("%s%s%s",
-                    arg->type == C_Flag ? "--" : "<",
-                    arg->name,
-                    arg->type == C_Flag ? ""   : ">");
-}
-
-static int compare_command_name(const void *a, const void *b)
-{
-    return strcmp((*(struct command **)a)->name, (*(struct command **)b)->name);
-}
-
-static int help(char **arg)
-{
-    if (arg[1]) {
-        struct command *c = find_command(arg[1]);
-        if (!c) {
-            printf("No such command: '%s'\n", arg[1]);
-            return 0;
-        }
-        printf("%s:\n  %s\n\nUsage:\n  %s", c->name, c->help, c->name);
-        for (int a=0; c->arg[a].name; a++) {
-            printf(" %s%s%s",
-                   c->arg[a].type & C_Optional ? "[ " : "",
-                   arg_name(&c->arg[a]),
-                   c->arg[a].type & C_Optional ? " ]" : "");
-        }
-        printf("\n\nArguments:\n");
-        for (int a=0; c->arg[a].name; a++) {
-            printf("  %s: %s\n", arg_name(&c->arg[a]), c->arg[a].help);
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            err(1, "Lost track of workers");
         }
-        return 0;
-    }
-
-    printf("Commands:\n");
-    int width=0, count=0;
-    foreach_autolist(struct command *c, command) {
-        width=MAX(width, strlen(c->name));
-        count++;
+        running--;
+        for (int d=0; d<next; d++)
+            if (worker[d] == pid) {
+                print_output(device_name[d], output[d]);
+                fclose(output[d]);
+                if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                    fprintf(stderr, "%s: Failed (%s %d).\n", device_name[d],
+                            WIFEXITED(status) ? "status" : "signal", WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+                    failed++;
+                }
+                break;
+            }
     }
+    return failed ? 1 : 0;
+}
+
+// --serve keeps devices and their tables open and runs commands for clients on a Unix domain socket. It's meant for
+// tools that want to make lots of small queries without starting a new gdisk (and re-reading the table) each time.
+//
+// The protocol is the command language, one command per line. "device <name>" picks the device the following commands
+// go to (opening it the first time anyone asks for it). The response to each line is whatever the command printed,
+// then a '\0', then its status as a decimal number and a '\n'. "quit" closes the connection.
+//
+// Commands print straight to stdout and stderr, so two of them can't run in one process at once. So, like --jobs, each
+// device gets its own worker process, which opens it, holds its table and runs its commands one at a time, answering in
+// the same protocol over a socketpair. That serializes each device without holding up the others while one of them
+// does something slow (a write and its fsyncs, say). Tables are shared between the clients using them and changes stay
+// in memory until someone writes them.
+//
+// The server itself only passes lines and responses along and never blocks on anybody. Each worker has one line at a
+// time and the rest wait in its queue. A client's next line isn't looked at (or read) until the response to its last
+// one is all sent, so a client that stops reading only stalls itself.
+struct request {
+    int client; // Id of the client waiting for the answer
+    char *line; // What to send the worker. NULL when the answer is to it opening the device.
+    bool select; // "device <name>": a good answer makes it the client's device
+};
 
-    struct command *command[count], **c = command;
-    foreach_autolist(struct command *cmd, command)
-        *c++ = cmd;
-    qsort(command, count, sizeof(*command), compare_command_name);
-
-    for (c=command; c < &command[count]; c++)
-        printf("%-*s %s\n", width+2, (*c)->name, (*c)->help);
+struct served_device {
+    char *name;
+    pid_t pid;
+    int fd;                 // Socket to the worker. -1 once it has gone away.
+    struct request *queue;  // The first one is with the worker
+    int queued;
+    char *response;         // What the worker has answered to the first one so far
+    size_t length;
+};
 
-    return 0;
-}
-command_add("help", help, "Show a list of commands",
-            command_arg("command", C_String|C_Optional, "Command to get help with"));
+struct client {
+    int id;
+    int fd;
+    int device;   // Index into the served devices, or -1
+    bool waiting; // For a worker to answer
+    char *buffer; // Received, not run yet
+    size_t length;
+    char *out;    // Response not sent yet
+    size_t out_length, sent;
+    bool eof, quit, gone;
+};
 
-static int quit(char **arg)
-{
-    return ECANCELED; // total special case. Weak.
-}
-command_add("quit", quit, "Quit, leaving the disk untouched.");
+struct server {
+    int listener;
+    struct served_device *device;
+    int devices;
+    struct client *client;
+    int clients, next_id;
+};
 
-static char *command_completion(const char *text, int state)
+// A device's worker. Its stdin, stdout and stderr are its socket to the server. Answers once it has opened the device,
+// and then once for each line.
+static void serve_device(char *name)
 {
-    int i=0;
-    foreach_autolist(struct command *c, command)
-        if (strncmp(text, c->name, strlen(text)) == 0 &&
-            i++ == state)
-            return xstrdup(c->name);
-    return NULL;
-}
+    struct partition_table table;
+    int status = open_table(name, direct_io, io_backend, &table);
+    printf("%c%d\n", '\0', status ? ENODEV : 0);
+    fflush(stdout);
+    if (status)
+        exit(1);
+    table.settings = (struct settings) { .fit = default_fit, .align = default_align };
 
-static char *partition_size_completion(const char *text, int state)
-{
-    struct free_space *space = find_free_spaces(g_table);
-    char *size = NULL;
-    for (int i=0, s=0; i<space[i].blocks; i++) {
-        char *_size = NULL; asprintf(&_size, "%"PRId64, space[i].blocks * g_table.dev->sector_size);
-        if (strncasecmp(text, _size, strlen(text)) == 0 && s++ == state) {
-            size = _size;
-            break;
-        }
-        free(_size);
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, stdin) > 0) {
+        status = run_command(&table, line, NULL, NULL);
+        fflush(stdout);
+        printf("%c%d\n", '\0', status);
+        fflush(stdout);
     }
-    free(space);
-    return size;
+    exit(0);
 }
 
-static char *partition_type_completion(const char *text, int state)
+// Starts a worker for |name|. Returns its index in the served devices, or -1 (with errno set) if it couldn't.
+static int spawn_device(struct server *s, char *name)
 {
-    for (int i=0, s=0; gpt_partition_type[i].name; i++) {
-        char *_name = trdup(gpt_partition_type[i].name, " ", "_");
-        if (strncasecmp(text, _name, strlen(text)) == 0 &&
-            s++ == state)
-            return _name;
-        free(_name);
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+        return -1;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        int error = errno;
+        close(pair[0]);
+        close(pair[1]);
+        errno = error;
+        return -1;
     }
+    if (pid == 0) {
+        close(s->listener);
+        for (int c=0; c<s->clients; c++)
+            close(s->client[c].fd);
+        for (int d=0; d<s->devices; d++)
+            if (s->device[d].fd != -1)
+                close(s->device[d].fd);
+        close(pair[0]);
+        dup2(pair[1], 0);
+        dup2(pair[1], 1);
+        dup2(pair[1], 2);
+        close(pair[1]);
+        serve_device(name);
+    }
+    close(pair[1]);
+    s->device = xrealloc(s->device, sizeof(*s->device) * (s->devices + 1));
+    s->device[s->devices] = (struct served_device) { .name = xstrdup(name), .pid = pid, .fd = pair[0] };
+    return s->devices++;
+}
+
+static struct client *find_client(struct server *s, int id)
+{
+    for (int c=0; c<s->clients; c++)
+        if (s->client[c].id == id)
+            return &s->client[c];
     return NULL;
 }
 
-static void update_gpt_crc(struct gpt_header *h, struct gpt_partition *p)
+static void queue_output(struct client *client, char *data, size_t length)
 {
-    h->partition_crc32 = gpt_partition_crc32(h, p);
-    h->header_crc32 = gpt_header_crc32(h);
+    if (!length) return;
+    client->out = xrealloc(client->out, client->out_length + length);
+    memcpy(client->out + client->out_length, data, length);
+    client->out_length += length;
 }
 
-static void update_table_crc(struct partition_table *t)
+// Queues a response the server makes up itself, for lines no worker needs to see.
+static void respond(struct client *client, int status, char *format, ...)
 {
-    update_gpt_crc(t->header,     t->partition);
-    update_gpt_crc(t->alt_header, t->partition);
-}
-
-static bool gpt_crc_valid(struct gpt_header *h, struct gpt_partition *p)
-{
-    return h->partition_crc32 == gpt_partition_crc32(h, p) && h->header_crc32 == gpt_header_crc32(h);
-}
-
-static void utf16_from_ascii(uint16_t *utf16le, char *ascii, int n)
-{
-    if (!n) return;
-    while (--n && (*utf16le++ = *ascii++)) {}
-    *utf16le = '\0';
-}
-
-static bool partition_entry_is_representable_in_mbr(struct gpt_partition entry)
-{
-    // MBR only has 32 bits for the LBA. So if the partition is further up the disk than that then it can't be represented in the MBR.
-    return !guid_eq(gpt_partition_type_empty, entry.partition_type) &&
-           entry.first_lba < 0x100000000LL &&
-           entry.last_lba - entry.first_lba < 0x100000000LL;
+    va_list ap;
+    va_start(ap, format);
+    char *text;
+    int length = vxsprintf(&text, format, ap);
+    va_end(ap);
+    queue_output(client, text, length);
+    free(text);
+    char trailer[32];
+    queue_output(client, trailer, snprintf(trailer, sizeof(trailer), "%c%d\n", '\0', status));
 }
 
-static void create_mbr_alias_table(struct partition_table *t)
+// Hands |d|'s worker the first request in its queue. It's idle, so this only waits for it to read the line. If it has
+// died, the EOF on its socket takes care of the request.
+static void send_request(struct served_device *d)
 {
-    int synced = -1;
-    for (int i=0; i<lengthof(t->alias); i++)
-        t->alias[i] = -1;
-    for (int mp=0; mp<lengthof(t->mbr.partition); mp++) {
-        if (!t->mbr.partition[mp].partition_type)
+    char *line = d->queue[0].line;
+    for (size_t length = line ? strlen(line) : 0; length; ) {
+        ssize_t wrote = write(d->fd, line, length);
+        if (wrote == -1 && errno == EINTR)
             continue;
-        for (int gp=0; gp<t->header->partition_entries; gp++)
-            if (partition_entry_is_representable_in_mbr(t->partition[gp]) &&
-                (t->mbr.partition[mp].first_sector_lba == t->partition[gp].first_lba ||
-                 // first partition could be type EE which covers the GPT partition table and the optional EFI filesystem.
-                 // The EFI filesystem in the GPT doesn't cover the EFI partition table, so the starts might not line up.
-                 t->mbr.partition[mp].first_sector_lba == 1 && t->mbr.partition[mp].partition_type == 0xee) &&
-                t->mbr.partition[mp].first_sector_lba + t->mbr.partition[mp].sectors == t->partition[gp].last_lba + 1) {
-                t->alias[mp] = gp;
-                if (synced < 0) synced = 1;
-                break;
-            }
-        if (t->alias[mp] == -1)
-            synced = 0;
-    }
-    t->options.mbr_sync = synced == 1;
-}
-
-static unsigned long partition_sectors(struct partition_table t)
-{
-    return divide_round_up(t.header->partition_entry_size * t.header->partition_entries, t.dev->sector_size);
-}
-
-static struct partition_table blank_table(struct device *dev)
-{
-    struct partition_table t = {};
-    t.dev = dev;
-    t.header = alloc_sectors(dev, 1);
-    t.alt_header = alloc_sectors(dev, 1);
-    const int partitions = 128;
-    const int partition_sectors = divide_round_up(partitions * sizeof(struct gpt_partition), dev->sector_size);
-    *t.header = (struct gpt_header) {
-               .signature = "EFI PART",
-               .revision = PARTITION_REVISION,
-               .header_size = sizeof(struct gpt_header),
-               .my_lba = 1,
-               .alternate_lba = dev->sector_count-1,
-               .first_usable_lba = 2                  + partition_sectors,
-               .last_usable_lba = dev->sector_count-2 - partition_sectors,
-               .disk_guid = guid_create(),
-               .partition_entry_lba = 2,
-               .partition_entries = partitions,
-               .partition_entry_size = sizeof(struct gpt_partition),
-    };
-
-    *t.alt_header = *t.header;
-    t.alt_header->alternate_lba       = t.header->my_lba;
-    t.alt_header->my_lba              = t.header->alternate_lba;
-    t.alt_header->partition_entry_lba = t.header->last_usable_lba + 1;
-
-    t.partition = alloc_sectors(dev, partition_sectors);
-
-    for (int i=0; i<lengthof(t.alias); i++)
-        t.alias[i] = -1;
-
-    return t;
-}
-
-static int command_clear_table(char **arg)
-{
-    struct mbr mbr = g_table.mbr;
-    g_table = blank_table(g_table.dev);
-    g_table.mbr = mbr;
-    return 0;
-}
-command_add("clear-table", command_clear_table, "Clear out GPT partition table for a nice fresh start.");
-
-static struct mbr blank_mbr(struct device *dev)
-{
-    struct mbr mbr = { .mbr_signature = MBR_SIGNATURE };
-    // Even a blank MBR should preserve the boot code.
-    struct mbr code = read_mbr(dev);
-    memcpy(mbr.code, code.code, sizeof(mbr.code));
-    return mbr;
-}
-
-static int command_clear_mbr(char **arg)
-{
-    g_table.mbr = blank_mbr(g_table.dev);
-    create_mbr_alias_table(&g_table);
-    return 0;
-}
-command_add("clear-mbr", command_clear_mbr, "Clear out MBR partition table and start anew.");
-
-static int command_create_protective_mbr(char **arg)
-{
-    g_table.mbr = blank_mbr(g_table.dev);
-    g_table.mbr.partition[0] = (struct mbr_partition) {
-        .first_sector_lba = 1,
-        .sectors = g_table.dev->sector_count-1,
-        .partition_type = 0xee,
-    };
-    create_mbr_alias_table(&g_table);
-    return 0;
-}
-command_add("create-protective-mbr", command_create_protective_mbr, "Replace MBR entries with a protective MBR as per the EFI spec.");
-
-static int command_add_protective_mbr_partition(char **arg)
-{
-    struct partition_table *t = &g_table;
-    for (int i=0; i < lengthof(t->mbr.partition); i++)
-        if (t->mbr.partition[i].partition_type == 0) {
-            t->mbr.partition[i] = (struct mbr_partition) {
-                .first_sector_lba = 1,
-                .sectors = g_table.header->first_usable_lba-1-1/*mbr*/,
-                .partition_type = 0xee,
-            };
-            return 0;
-        }
-    fprintf(stderr, "No free MBR partitions found.\n");
-    return ENOSPC;
-}
-command_add("add-protective-mbr-partition", command_add_protective_mbr_partition, "Add a protective MBR entry that just covers the EFI partitioning sectors.");
-
-static struct partition_table gpt_table_from_mbr(struct mbr mbr, struct device *dev)
-{
-    struct partition_table t = blank_table(dev);
-    t.mbr = mbr;
-    for (int mp=0,gp=0; mp<lengthof(t.mbr.partition); mp++) {
-        if (t.mbr.partition[mp].partition_type) {
-            if (t.mbr.partition[mp].partition_type == 0xee)
-                continue;
-
-            t.partition[gp].first_lba = t.mbr.partition[mp].first_sector_lba;
-            t.partition[gp].last_lba  = t.mbr.partition[mp].first_sector_lba + t.mbr.partition[mp].sectors - 1;
-
-            if (t.partition[gp].first_lba < t.header->first_usable_lba ||
-                t.partition[gp].last_lba > t.header->last_usable_lba)
-                printf("ouch, mbr partition %d [%"PRId64"d,%"PRId64"d] outside of usable gpt space [%"PRId64"d,%"PRId64"d]\n",
-                       mp+1, t.partition[gp].first_lba, t.partition[gp].last_lba, t.header->first_usable_lba, t.header->last_usable_lba);
-
-            utf16_from_ascii(t.partition[gp].name, csprintf("MBR %d\n", mp+1), lengthof(t.partition[gp].name));
-
-            for (int i=0; gpt_partition_type[i].name; i++)
-                for (int j=0; gpt_partition_type[i].mbr_equivalent[j]; j++)
-                    if (t.mbr.partition[mp].partition_type == gpt_partition_type[i].mbr_equivalent[j]) {
-                        t.partition[gp].partition_type = gpt_partition_type[i].guid;
-                        goto found;
-                    }
-            // Not found, use gdisk specific guid to mean "unknown".
-            t.partition[gp].partition_type = GUID(b334117e,118d,11de,9b0f,001cc0952d53);
-
-          found:
-            t.partition[gp].partition_guid = guid_create();
-            t.alias[mp] = gp++;
-        }
+        if (wrote == -1)
+            break;
+        line += wrote;
+        length -= wrote;
     }
-    t.options.mbr_sync = true;
-    update_table_crc(&t);
-    return t;
-}
-static int gpt_from_mbr(char **arg)
-{
-    struct device *dev = g_table.dev;
-    struct mbr mbr = g_table.mbr;
-    free_table(g_table);
-    g_table = gpt_table_from_mbr(mbr, dev);
-    return 0;
 }
-command_add("init-gpt-from-mbr", gpt_from_mbr, "(Re)create GPT partition table using data from the MBR partition table");
 
-static int recreate_gpt(char **arg)
+static void queue_request(struct server *s, int d, struct client *client, char *line, bool select)
 {
-    struct partition_table new_table = blank_table(g_table.dev);
-    new_table.header->disk_guid = new_table.alt_header->disk_guid = g_table.header->disk_guid;
-    assert(new_table.header->partition_entries == g_table.header->partition_entries);
-    /* Should never happen because for now all gpt partitions have the same number of entries: */
-    if (new_table.header->partition_entries < g_table.header->partition_entries)
-        fprintf(stderr, "Warning: new partition table has less partition entries (%d) than the old table (%d). Some partitions may be dropped.\n",
-                new_table.header->partition_entries, g_table.header->partition_entries);
-    struct partition_table gt = g_table;
-    g_table.header = new_table.header;
-    g_table.alt_header = new_table.alt_header;
-    new_table.header = gt.header;
-    new_table.alt_header = gt.alt_header;
-    free_table(new_table);
-    update_table_crc(&g_table);
-    return 0;
+    struct served_device *dev = &s->device[d];
+    dev->queue = xrealloc(dev->queue, sizeof(*dev->queue) * (dev->queued + 1));
+    dev->queue[dev->queued++] = (struct request) { .client = client->id, .line = line, .select = select };
+    client->waiting = true;
+    if (dev->queued == 1)
+        send_request(dev);
 }
-command_add("recreate-gpt", recreate_gpt, "Recreate GPT partition table using partitions in current GPT. Useful for resizing disks.");
 
-static struct partition_table read_gpt_table(struct device *dev)
+// Starts on one line from |client|: either hands it to a worker or answers it straight away.
+static void serve_line(struct server *s, struct client *client, char *line)
 {
-    struct partition_table t = {};
-    t.dev = dev;
-
-    bool primary_valid = true, alternate_valid = true;
-
-#define header_error(format, ...) ({                        \
-            fprintf(stderr, format, ##__VA_ARGS__);         \
-            fprintf(stderr, ". Assuming blank partition...\n");   \
-            free_table(t);                                  \
-            blank_table(dev);                               \
-        })
-
-#define header_warning(format, ...) ({              \
-            fprintf(stderr, "Warning: ");           \
-            fprintf(stderr, format, ##__VA_ARGS__); \
-            fprintf(stderr, ".\n");                 \
-        })
-
-#define header_corrupt(which, format, ...) ({                             \
-        header_warning(format, ##__VA_ARGS__);                            \
-        which ## _valid = false;                                          \
-        if (!primary_valid && !alternate_valid)                           \
-            return header_error("There were no valid GPT headers found"); \
-        })
-
-    t.header = get_sectors(dev,1,1);
-
-    if (memcmp(t.header->signature, "EFI PART", sizeof(t.header->signature)) != 0)
-        header_corrupt(primary, "Missing signature in primary GPT header");
-    else
-        gpt_header_to_host(t.header);
-
-    t.alt_header = get_sectors(dev, primary_valid ? t.header->alternate_lba : dev->sector_count-1, 1);
-
-    if (memcmp(t.alt_header->signature, "EFI PART", sizeof(t.alt_header->signature)) != 0)
-        header_corrupt(alternate, "Missing signature in altername GPT header");
-    else
-        gpt_header_to_host(t.alt_header);
-
-    if (primary_valid && t.header->header_size != sizeof(struct gpt_header))
-        header_corrupt(primary, "Partition header is %d bytes long instead of %zd", t.header->header_size, sizeof(struct gpt_header));
-
-    if (alternate_valid && t.alt_header->header_size != sizeof(struct gpt_header))
-        header_corrupt(alternate, "Partition header is %d bytes long instead of %zd", t.header->header_size, sizeof(struct gpt_header));
-
-    if (primary_valid && t.header->partition_entry_size != sizeof(struct gpt_partition))
-        header_corrupt(primary, "Size of partition entries are %d instead of %zd", t.header->partition_entry_size, sizeof(struct gpt_partition));
-
-    if (alternate_valid && t.alt_header->partition_entry_size != sizeof(struct gpt_partition))
-        header_corrupt(alternate, "Size of partition entries are %d instead of %zd", t.alt_header->partition_entry_size, sizeof(struct gpt_partition));
-
-    uint64_t primary_lba,alternate_lba;
-    if (primary_valid && alternate_valid && t.header->my_lba != t.alt_header->alternate_lba) {
-        header_warning("Header LBA is %"PRId64" but alternate header claims it is %"PRId64"", t.header->my_lba, t.header->alternate_lba);
-        if (t.header->my_lba == 1 || t.alt_header->alternate_lba == 1)
-            primary_lba = 1; // It *really* should be one.
+    line = trim(line);
+    if (strncmp(line, "device", 6) == 0 && (!line[6] || isspace(line[6]))) {
+        char *name = trim(line + 6);
+        int d;
+        for (d=0; d<s->devices; d++)
+            if (s->device[d].fd != -1 && strcmp(s->device[d].name, name) == 0)
+                break;
+        if (!*name)
+            respond(client, ENODEV, "Usage: device <name>\n");
+        else if (d < s->devices)
+            queue_request(s, d, client, xstrdup("\n"), true); // Answered once the worker has opened it
+        else if ((d = spawn_device(s, name)) == -1)
+            respond(client, ENODEV, "Couldn't start a worker for %s: %s\n", name, strerror(errno));
         else
-            primary_lba = t.header->my_lba; // In any other screwball case, trust the primary header.
-    } else
-        primary_lba = primary_valid ? t.header->my_lba : t.alt_header->alternate_lba;
-
-    if (primary_lba != 1)
-        header_warning("Header LBA is %"PRId64" and not 1", primary_lba);
-
-    if (primary_valid && alternate_valid && t.header->alternate_lba != t.alt_header->my_lba) {
-        header_warning("Primary header says Alternate header LBA is %"PRId64" but alternate header claims it is %"PRId64"", t.header->alternate_lba, t.header->my_lba);
-        if (t.header->my_lba == dev->sector_count-1 || t.alt_header->alternate_lba == dev->sector_count-1)
-            alternate_lba = dev->sector_count-1;
+            queue_request(s, d, client, NULL, true);
+    } else if (!*line || *line == '#')
+        respond(client, 0, "");
+    else if (client->device < 0)
+        respond(client, ENODEV, "No device selected. Use \"device <name>\" first.\n");
+    else if (s->device[client->device].fd == -1) {
+        respond(client, ENODEV, "%s has gone away. Use \"device <name>\" to open it again.\n", s->device[client->device].name);
+        client->device = -1;
+    } else {
+        char *request;
+        xsprintf(&request, "%s\n", line);
+        queue_request(s, client->device, client, request, false);
+    }
+}
+
+// Sends as much of |client|'s response as it will take right now. false if the client has gone away.
+static bool send_response(struct client *client)
+{
+    while (client->sent < client->out_length) {
+        ssize_t sent = send(client->fd, client->out + client->sent, client->out_length - client->sent, MSG_DONTWAIT);
+        if (sent == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        client->sent += sent;
+    }
+    client->out_length = client->sent = 0;
+    return true;
+}
+
+// Starts on the lines |client| has sent, one at a time, for as long as it keeps up with the responses. false if the
+// client has gone away.
+static bool serve_client(struct server *s, struct client *client)
+{
+    char *rest = client->buffer;
+    while (rest && !client->quit && !client->waiting && !client->out_length) {
+        char *line = rest, *end = strchr(rest, '\n');
+        if (end) {
+            *end = '\0';
+            rest = end + 1;
+        } else if (client->eof && *rest) // The last line doesn't need a newline
+            rest += strlen(rest);
         else
-            alternate_lba = t.header->alternate_lba; // In any other screwball case, trust the primary header.
-    } else
-        alternate_lba = primary_valid ? t.header->alternate_lba : t.alt_header->my_lba;
-
-    if (alternate_lba != dev->sector_count-1)
-        header_warning("Alternate header LBA is %"PRId64" and not at the end of the disk (LBA: %llu)", alternate_lba, dev->sector_count-1);
-
-    // Technically we can guess the start lba and check the validity of the opposite table if the one we're looking at doesn't CRC..
-    if (primary_valid) {
-        if (t.header->partition_entries * t.header->partition_entry_size / dev->sector_size > dev->sector_count/2)
-            header_corrupt(primary, "The number of partition_entries is ludicrous: %d", t.header->partition_entries);
-        else {
-            t.partition = get_sectors(dev, t.header->partition_entry_lba, divide_round_up(t.header->partition_entry_size * t.header->partition_entries,dev->sector_size));
-            gpt_partition_to_host(t.partition, t.header->partition_entries);
-
-            if (!gpt_crc_valid(t.header, t.partition)) {
-                header_warning("Header CRC is not valid. Fixing.");
-                update_table_crc(&t);
-            }
-        }
-    } else if (alternate_valid) {
-        if (t.alt_header->partition_entries * t.alt_header->partition_entry_size / dev->sector_size > dev->sector_count/2)
-            header_corrupt(alternate, "The number of partition_entries is ludicrous: %d", t.alt_header->partition_entries);
-        else {
-            t.partition = get_sectors(dev, t.alt_header->partition_entry_lba, divide_round_up(t.alt_header->partition_entry_size * t.alt_header->partition_entries,dev->sector_size));
-            gpt_partition_to_host(t.partition, t.alt_header->partition_entries);
-
-            if (!gpt_crc_valid(t.alt_header, t.partition)) {
-                header_warning("Alt Header CRC is not valid. Fixing.");
-                update_table_crc(&t);
-            }
-        }
-    }
-
-    #warning "TODO: Sanity check first_usable_lba and last_usable_lba."
-
-    // If one is bad, fix it from the other one...
-    if (primary_valid && !alternate_valid) {
-        *t.alt_header = *t.header;
-        uint64_t temp = t.alt_header->my_lba;
-        t.alt_header->my_lba = t.alt_header->alternate_lba;
-        t.alt_header->alternate_lba = temp;
-        t.alt_header->partition_entry_lba = t.alt_header->last_usable_lba + 1;
-    } else if (!primary_valid && alternate_valid) {
-        *t.header = *t.alt_header;
-        uint64_t temp = t.header->my_lba;
-        t.header->my_lba = t.header->alternate_lba;
-        t.header->alternate_lba = temp;
-        t.header->partition_entry_lba = t.header->my_lba + 1;
-    }
-
-    #warning "TODO: Capture both sets of partition tables in case on has a bad crc."
-
-    return t;
-}
-
-static struct partition_table read_table(struct device *dev)
-{
-    struct partition_table t = read_gpt_table(dev);
-
-    t.mbr = read_mbr(dev);
-
-    create_mbr_alias_table(&t);
-
-    return t;
-}
-
-#warning "TODO: Add 'fix' command that moves alternate partition and header to end of disk"
-#warning "TODO: Add 'new-guids' command (with better name) that recreates all the guids in the table (run it after an image copy)"
-
-static void free_table(struct partition_table t)
-{
-    free(t.header);
-    free(t.alt_header);
-    free(t.partition);
-}
-
-static struct partition_table dup_table(struct partition_table t)
-{
-    struct partition_table dup;
-    dup = t;
-    dup.header = xmemdup(t.header, t.dev->sector_size);
-    dup.alt_header = xmemdup(t.alt_header, t.dev->sector_size);
-    dup.partition = xmemdup(t.partition, partition_sectors(t) * t.dev->sector_size);
-    return dup;
-}
-
-static int compare_partition_entries(const void *_a, const void *_b)
-{
-    const struct gpt_partition *a = _a, *b = _b;
-    int a_empty = guid_eq(gpt_partition_type_empty, a->partition_type),
-        b_empty = guid_eq(gpt_partition_type_empty, b->partition_type);
-    if (a_empty || b_empty)
-        return a_empty - b_empty;
-    return (long long)a->first_lba - (long long)b->first_lba;
-}
-
-static void compact_and_sort(struct partition_table *t)
-{
-    qsort(t->partition, t->header->partition_entries, sizeof(*t->partition), compare_partition_entries);
-    update_table_crc(&g_table);
-    create_mbr_alias_table(t);
-}
-
-static int command_compact_and_sort(char **arg)
-{
-    compact_and_sort(&g_table);
-    return 0;
-}
-command_add("compact-and-sort", command_compact_and_sort, "Remove \"holes\" from table and sort entries in ascending order");
-
-static struct gpt_partition *find_unused_partition(struct partition_table t)
-{
-    for (int i=0; i<t.header->partition_entries; i++)
-        if (guid_eq(gpt_partition_type_empty, g_table.partition[i].partition_type))
-            return &g_table.partition[i];
-    return NULL;
-}
-
-static struct free_space *find_free_spaces(struct partition_table unsorted)
-{
-    // To make this sane we sort the partition table first.
-    struct partition_table t = dup_table(unsorted);
-    compact_and_sort(&t);
-
-    uint64_t free_start = t.header->first_usable_lba;
-    struct free_space *space = malloc(sizeof(*space)*(t.header->partition_entries+1+1/*NULL*/));
-    int s=0;
-    for (int p=0; p<t.header->partition_entries; p++) {
-        if (guid_eq(gpt_partition_type_empty, t.partition[p].partition_type))
             break;
-        if (t.partition[p].first_lba - free_start > 0)
-            space[s++] = (struct free_space) { .blocks = t.partition[p].first_lba - free_start,
-                                               .first_lba = free_start };
-        free_start = t.partition[p].last_lba + 1;
+        serve_line(s, client, line);
+        if (!send_response(client))
+            return false;
     }
-    // Check for it fitting in the end (probably the most common case)
-    if (t.header->last_usable_lba+1 - free_start > 0)
-        space[s++] = (struct free_space) { .blocks = t.header->last_usable_lba+1 - free_start,
-                                           .first_lba = free_start };
-    space[s++] = (struct free_space) { };
-
-    free_table(t);
-    return space;
-}
-
-static uint64_t find_free_space(struct partition_table unsorted, uint64_t blocks)
-{
-    uint64_t start = -1LL;
-    struct free_space *space = find_free_spaces(unsorted);
-    for (int i=0; i<space[i].blocks; i++)
-        if (space[i].blocks >= blocks) {
-            start = space[i].first_lba;
-            break;
-        }
-    free(space);
-    return start;
-}
-
-static struct free_space largest_free_space(struct partition_table unsorted)
-{
-    struct free_space found = { .blocks = 0 };
-    struct free_space *space = find_free_spaces(unsorted);
-    for (int i=0; i<space[i].blocks; i++)
-        if (space[i].blocks >= found.blocks)
-            found = space[i];
-    free(space);
-    return found;
+    if (rest) {
+        client->length -= rest - client->buffer;
+        memmove(client->buffer, rest, client->length + 1);
+    }
+    return true;
 }
 
-
-static GUID type_guid_from_string(char *s)
+// Passes a response from a worker (or, with |response| NULL, the news that it's gone) to the client that asked, and
+// gets that client going on its next line.
+static void answer(struct server *s, int d, struct request *r, char *response, size_t length)
 {
-    for (int t=0; gpt_partition_type[t].name; t++) {
-        if (strcasecmp(s, ctr(gpt_partition_type[t].name, " ", "_")) == 0)
-            return gpt_partition_type[t].guid;
+    struct client *client = find_client(s, r->client);
+    free(r->line);
+    if (!client) // Hung up while it waited
+        return;
+    client->waiting = false;
+    if (!response)
+        respond(client, ENODEV, "%s has gone away.\n", s->device[d].name);
+    else {
+        size_t output = strlen(response); // Up to the '\0'
+        int status = atoi(response + output + 1);
+        if (r->select && !status)
+            client->device = d;
+        client->quit = status == ECANCELED;
+        queue_output(client, response, client->quit ? output /*quit*/ : length);
     }
-    return guid_from_string(s);
+    client->gone = !send_response(client) || !serve_client(s, client);
 }
 
-static bool sync_partition_to_mbr(struct partition_table *t, int gpt_index)
+// Reads what |d|'s worker has to say and passes on each whole response. false if the worker has gone away.
+static bool worker_output(struct server *s, int d)
 {
-    int mbr_type;
-    struct gpt_partition *p = &t->partition[gpt_index];
-    if (!partition_entry_is_representable_in_mbr(*p) ||
-        !(mbr_type = find_mbr_equivalent(p->partition_type)))
+    char chunk[4096];
+    ssize_t got = read(s->device[d].fd, chunk, sizeof(chunk));
+    if (got == -1 && errno == EINTR)
+        return true;
+    if (got <= 0)
         return false;
-
-    for (int i=0; i < lengthof(t->mbr.partition); i++)
-        if (t->mbr.partition[i].partition_type == 0) {
-            t->mbr.partition[i] = (struct mbr_partition) {
-                .status = 0,
-                .first_sector = {}, // Need disk geometry to do this properly
-                .last_sector  = {}, // Need disk geometry to do this properly
-                .partition_type = mbr_type,
-                .first_sector_lba = p->first_lba,
-                .sectors = p->last_lba - p->first_lba + 1,
-            };
-            t->alias[i] = gpt_index;
-            return true;
+    struct served_device *dev = &s->device[d];
+    dev->response = xrealloc(dev->response, dev->length + got);
+    memcpy(dev->response + dev->length, chunk, got);
+    dev->length += got;
+
+    char *status;
+    while ((status = memchr(dev->response, '\0', dev->length)) &&
+           memchr(status, '\n', dev->length - (status - dev->response))) {
+        size_t length = (char *)memchr(status, '\n', dev->length - (status - dev->response)) + 1 - dev->response;
+        struct request r = dev->queue[0];
+        char *response = dev->response;
+        dev->response = xmemdup(response + length, dev->length - length);
+        dev->length -= length;
+        memmove(dev->queue, dev->queue + 1, sizeof(*dev->queue) * --dev->queued);
+        if (dev->queued) // Before answering, which might queue up something new
+            send_request(dev);
+        answer(s, d, &r, response, length);
+        free(response);
+        dev = &s->device[d]; // answer() may have started new workers
+    }
+    return true;
+}
+
+// |d|'s worker is gone (it couldn't open the device or it crashed). Everyone still waiting on it gets an error.
+static void worker_gone(struct server *s, int d)
+{
+    struct served_device *dev = &s->device[d];
+    close(dev->fd);
+    dev->fd = -1;
+    waitpid(dev->pid, NULL, 0);
+    free(dev->response);
+    dev->response = NULL;
+    dev->length = 0;
+    struct request *queue = dev->queue;
+    int queued = dev->queued;
+    dev->queue = NULL;
+    dev->queued = 0;
+    for (int q=0; q<queued; q++)
+        answer(s, d, &queue[q], NULL, 0);
+    free(queue);
+}
+
+static int serve(char *socket_path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        errx(1, "Socket path is too long: %s", socket_path);
+    strcpy(addr.sun_path, socket_path);
+    struct server s = { .listener = socket(AF_UNIX, SOCK_STREAM, 0) };
+    if (s.listener == -1)
+        err(1, "Couldn't create socket");
+    // Clear out a socket left behind by an earlier server, but never anything else that happens to have the name.
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EADDRINUSE;
+            err(1, "Couldn't listen on %s", socket_path);
         }
-    return false;
-}
-
-static int command_create_partition(char **arg)
-{
-    enum { Type=1, Size, Label, First_lba, Last_lba, System, Guid };
-    struct gpt_partition part = {};
-    part.partition_type = type_guid_from_string(arg[Type]);
-    if (guid_eq(bad_guid, part.partition_type)) {
-        fprintf(stderr, "Unknown GUID format: \"%s\"\n", arg[Type]);
-        return EINVAL;
-    }
-
-    part.partition_guid = arg[Guid] ? guid_from_string(arg[Guid]) : guid_create();
-    if (guid_eq(bad_guid, part.partition_guid)) {
-        fprintf(stderr, "Unknown GUID format: \"%s\"\n", arg[Guid]);
-        return EINVAL;
-    }
-
-    uint64_t size = human_size(arg[Size]);
-    uint64_t blocks = divide_round_up(size, g_table.dev->sector_size);
-
-    if (arg[First_lba] && !size && !arg[Last_lba]) {
-        fprintf(stderr, "If you specify the first LBA then you must give a size or a last LBA.\n");
-        return EINVAL;
-    }
-    if (size && arg[Last_lba]) {
-        fprintf(stderr, "You can't give both a size and a last LBA.\n");
-        return EINVAL;
-    }
-
-    if (!size && !arg[First_lba]) {
-        struct free_space largest = largest_free_space(g_table);
-        if (!largest.blocks) {
-            fprintf(stderr, "There is no free space left!\n");
-            return ENOSPC;
-        }
-        blocks = largest.blocks;
-        size = blocks * g_table.dev->sector_size;
-        part.first_lba = largest.first_lba;
-        printf("Largest unused space: %"PRId64" blocks (%"PRId64", %s) at block %"PRId64".\n",
-               blocks, size, human_string(size), part.first_lba);
-    } else
-        part.first_lba = arg[First_lba] ? strtoull(arg[First_lba], NULL, 0) : find_free_space(g_table, blocks);
-    if (part.first_lba == -1LL) {
-        fprintf(stderr, "Couldn't find %"PRId64" blocks (%"PRId64", %s) of free space.\n", blocks, size, human_string(size));
-        return ENOSPC;
-    }
-    part.last_lba = arg[Last_lba] ? strtoull(arg[Last_lba], NULL, 0) : part.first_lba + blocks - 1;
-    part.attributes = 0 | (arg[System] ? PA_SYSTEM_PARTITION : 0);
-    utf16_from_ascii(part.name, arg[Label] ? arg[Label] : "", lengthof(part.name));
-
-    if (part.last_lba < part.first_lba) {
-        fprintf(stderr, "Last LBA (%"PRIu64") must be larger than the Start LBA (%"PRIu64")\n", part.last_lba, part.first_lba);
-        return EINVAL;
-    }
-
-    if (part.first_lba < g_table.header->first_usable_lba) {
-        fprintf(stderr, "First LBA (%"PRIu64") must be greater (or equal) to the First Usable LBA (%"PRIu64")\n", part.first_lba, g_table.header->first_usable_lba);
-        return EINVAL;
-    }
-
-    if (part.last_lba > g_table.header->last_usable_lba) {
-        fprintf(stderr, "Last LBA (%"PRIu64") must be smaller than the Last Usable LBA (%"PRIu64")\n", part.last_lba, g_table.header->last_usable_lba);
-        return EINVAL;
-    }
-
-    dump_partition(&part);
-
-    struct gpt_partition *p = find_unused_partition(g_table);
-    if (!p) {
-        fprintf(stderr, "Partition table is full.\n");
-        return ENOSPC;
-    }
-
-    *p = part;
-
-    update_table_crc(&g_table);
-
-    if (g_table.options.mbr_sync)
-        sync_partition_to_mbr(&g_table, p - g_table.partition);
-
-    return 0;
-}
-
-command_add("new", command_create_partition, "Create a new partition entry in the table",
-            command_arg("type",      C_Partition_Type,    "Type of new partition"),
-            command_arg("size",      C_FreeSpace,         "Size of the new partition"),
-            command_arg("label",     C_String|C_Optional, "The name of the new partition"),
-            command_arg("first_lba", C_String|C_Optional, "The first block of the new partition"),
-            command_arg("last_lba",  C_String|C_Optional, "The last block of the new partition (this overrides the size argument)"),
-            command_arg("system",    C_Flag,              "Set the \"System Partition\" attribute"),
-            command_arg("guid",      C_String|C_Optional, "The GUID of the new partition")
-            );
-
-static int get_mbr_alias(struct partition_table t, int index)
-{
-    for (int m=0; m<lengthof(t.alias); m++)
-        if (g_table.alias[m] == index)
-            return m;
-    return -1;
-}
-
-static void delete_mbr_partition(struct partition_table *t, int mbr_index)
-{
-    memset(&t->mbr.partition[mbr_index], 0, sizeof(*t->mbr.partition));
-    t->alias[mbr_index] = -1;
-}
-
-static int choose_partition(char *string)
-{
-    int index = strtol(string, NULL, 0);
-    if (index < 0 || index >= g_table.header->partition_entries) {
-        fprintf(stderr, "Bad index '%d'. Should be between 0 and %d (inclusive).\n", index, g_table.header->partition_entries-1);
-        return -1;
-    }
-    if (guid_eq(g_table.partition[index].partition_type, gpt_partition_type_empty)) {
-        fprintf(stderr, "Partition '%d' is empty.\n", index);
-        return -1;
-    }
-    return index;
-}
-
-static int command_delete_partition(char **arg)
-{
-    int index = choose_partition(arg[1]);
-    if (index < 0) return EINVAL;
-
-    memset(&g_table.partition[index], 0, sizeof(g_table.partition[index]));
-    update_table_crc(&g_table);
-    int mbr_alias = get_mbr_alias(g_table, index);
-    if (g_table.options.mbr_sync && mbr_alias != -1)
-        delete_mbr_partition(&g_table, mbr_alias);
-    return 0;
-}
-
-command_add("delete", command_delete_partition, "Delete a partition from the table",
-            command_arg("index",     C_Number, "The index number of the partition. The first partition is partition zero"));
-
-static int command_sync_mbr(char **arg)
-{
-    if (g_table.options.mbr_sync && !arg[1]) {
-        fprintf(stderr, "MBR is already synced to GPT. Use --force flag to force a re-sync.\n");
-        return EEXIST;
-    }
-    for (int i=0; i < lengthof(g_table.mbr.partition); i++)
-        delete_mbr_partition(&g_table, i);
-
-    for (int i=0; i < g_table.header->partition_entries; i++)
-        sync_partition_to_mbr(&g_table, i);
-
-    g_table.options.mbr_sync = true;
-    return 0;
-}
-command_add("init-mbr-from-gpt", command_sync_mbr, "(Re)create MBR partition table using data from the GPT partition table",
-            command_arg("force",     C_Flag, "Force a re-sync if the MBR already looks synced"));
-
-static int command_sync_mbr_partition(char **arg)
-{
-    int index = choose_partition(arg[1]);
-    if (index < 0) return EINVAL;
-
-    if (!sync_partition_to_mbr(&g_table, index)) {
-        fprintf(stderr, "Error syncing partition %d.\n", index);
-        return -1;
-    }
-
-    return 0;
-}
-command_add("init-mbr-partition-from-gpt", command_sync_mbr_partition, "Create a single MBR partition using data from a GPT partition",
-            command_arg("gpt-partition-index", C_Number, "The index number of the source GPT partition. The first partition is partition zero")/*,
-            command_arg("mbr-partition-index", C_Number|C_Optional, "The index number of the destination MBR partition. The first partition is zero.")*/);
-
-static int command_edit(char **arg)
-{
-    int index = choose_partition(arg[1]);
-    if (index < 0) return EINVAL;
-
-    if (arg[2]) {
-        GUID type = type_guid_from_string(arg[2]);
-        if (guid_eq(bad_guid, type)) {
-            fprintf(stderr, "Not a valid type string or unknown GUID format: \"%s\"\n", arg[2]);
-            return EINVAL;
+        unlink(socket_path);
+    }
+    if (bind(s.listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(s.listener, SOMAXCONN) == -1)
+        err(1, "Couldn't listen on %s", socket_path);
+    signal(SIGPIPE, SIG_IGN); // A client going away mid-response shouldn't take everyone else with it.
+
+    struct pollfd *poll_fd = NULL;
+    for (;;) {
+        // Only what poll_fd covers gets looked at below. Anything new waits for the next time around.
+        int clients = s.clients, devices = s.devices;
+        poll_fd = xrealloc(poll_fd, sizeof(*poll_fd) * (1 + clients + devices));
+        poll_fd[0] = (struct pollfd) { .fd = s.listener, .events = POLLIN };
+        for (int c=0; c<clients; c++) {
+            struct client *client = &s.client[c];
+            bool busy = client->out_length || client->waiting || client->eof || client->quit;
+            short events = (client->out_length ? POLLOUT : 0) | (busy ? 0 : POLLIN);
+            // Leave out clients that are only waiting on a worker, or a hangup would wake us up until it answers.
+            poll_fd[1+c] = (struct pollfd) { .fd = events ? client->fd : -1, .events = events };
         }
-        g_table.partition[index].partition_type = type;
-
-        int mbr_alias = get_mbr_alias(g_table, index);
-        int mbr_type = find_mbr_equivalent(type);
-        if (g_table.options.mbr_sync && mbr_alias != -1 && mbr_type)
-            g_table.mbr.partition[mbr_alias].partition_type = mbr_type;
-        update_table_crc(&g_table);
-    }
-
-    if (arg[3]) {
-        utf16_from_ascii(g_table.partition[index].name, arg[3], lengthof(g_table.partition[index].name));
-        update_table_crc(&g_table);
-    }
-
-    if (arg[4]) {
-        GUID guid = guid_from_string(arg[4]);
-        if (guid_eq(bad_guid, guid)) {
-            fprintf(stderr, "Bad GUID: \"%s\"\n", arg[4]);
-            return EINVAL;
+        for (int d=0; d<devices; d++)
+            poll_fd[1+clients+d] = (struct pollfd) { .fd = s.device[d].fd, .events = POLLIN };
+        if (poll(poll_fd, 1 + clients + devices, -1) == -1) {
+            if (errno == EINTR) continue;
+            err(1, "poll");
         }
-        g_table.partition[index].partition_guid = guid;
-        update_table_crc(&g_table);
-    }
-
-    return 0;
-}
-command_add("edit", command_edit, "Change parts of a partition",
-            command_arg("index",     C_Number,                    "The index number of the partition. The first partitiion is partition zero"),
-            command_arg("type",      C_Partition_Type|C_Optional, "Type of partition"),
-            command_arg("label",     C_String|C_Optional,         "The name of the new partition"),
-            command_arg("guid",      C_String|C_Optional,         "The GUID of the new partition"));
-
-static int command_edit_attributes(char **arg)
-{
-    int index = choose_partition(arg[1]);
-    if (index < 0) return EINVAL;
-
-    uint64_t val = strcmp(arg[3], "system") == 0 ? PA_SYSTEM_PARTITION : strtoull(arg[3], NULL, 0);
-
-    if      (strcmp(arg[2], "set") == 0)
-        g_table.partition[index].attributes |=  val;
-    else if (strcmp(arg[2], "clear") == 0)
-        g_table.partition[index].attributes &= ~val;
-    else {
-        fprintf(stderr, "command \"%s\" is not \"set\" or \"clear\".\n", arg[2]);
-        return EINVAL;
-    }
-    printf("Attributes is now %"PRIx64" after %s %016"PRIx64"\n",
-           g_table.partition[index].attributes, strcmp(arg[2], "set") == 0 ? "setting" : "clearing", val);
-
-    return 0;
-}
-command_add("edit-attributes", command_edit_attributes, "Set or clear attribute bits of a partition",
-            command_arg("index",      C_Number, "The index number of the partition. The first partitiion is partition zero"),
-            command_arg("command",    C_String, "\"set\" or \"clear\" -- what you want to do to the bits"),
-            command_arg("attributes", C_String, "The bits you want to set or clear as a number (or \"system\" for \"System Partition\" attribute)"));
 
+        for (int d=0; d<devices; d++)
+            if (poll_fd[1+clients+d].revents && !worker_output(&s, d))
+                worker_gone(&s, d);
 
-static int command_edit_mbr(char **arg)
-{
-    int index = strtol(arg[1], NULL, 0);
-    if (index < 0 || index >= 4) {
-        fprintf(stderr, "Bad index '%d'. Should be between 0 and %d (inclusive).\n", index, 3);
-        return -1;
-    }
-    g_table.mbr.partition[index].partition_type = strtoul(arg[2], NULL, 16);
-    create_mbr_alias_table(&g_table); // It might have gotten out of sync.
-    return 0;
-}
-command_add("edit-mbr", command_edit_mbr, "Change details of an MBR partition",
-            command_arg("index",      C_Number, "The index number of the MBR partition. The first partitiion is partition zero"),
-            command_arg("type",       C_Number, "Type of partition (in hex)"));
-
-struct write_vec {
-    void *buffer;
-    unsigned long long block;
-    unsigned long long blocks;
-    char *name;
-};
-
-struct write_image {
-    struct write_vec vec[10];
-    int count;
-};
-
-struct write_image image_from_table(struct partition_table t)
-{
-    struct write_image image = { .count = 5 };
-
-    // *.front: mbr, then gpt header, then partitions
-    image.vec[0] = (struct write_vec) {
-        .buffer = sector_from_mbr(t.dev, t.mbr),
-        .block  = 0,
-        .blocks = 1,
-        .name = xstrdup("mbr"),
-    };
-
-    void *buffer = xcalloc(1, t.dev->sector_size);
-    gpt_header_from_host(t.header);
-    memcpy(buffer, t.header, sizeof(*t.header));
-    gpt_header_to_host(t.header);
-
-    image.vec[1] = (struct write_vec) {
-        .buffer = buffer,
-        .block  = t.header->my_lba,
-        .blocks = 1,
-        .name = xstrdup("gpt_header"),
-    };
-
-    buffer = xcalloc(t.header->partition_entries, t.dev->sector_size);
-    gpt_partition_from_host(t.partition, t.header->partition_entries);
-    memcpy(buffer, t.partition, sizeof(*t.partition) * t.header->partition_entries);
-    gpt_partition_to_host(t.partition, t.header->partition_entries);
-
-    image.vec[2] = (struct write_vec) {
-        .buffer = buffer,
-        .block  = t.header->partition_entry_lba,
-        .blocks = partition_sectors(t),
-        .name = xstrdup("gpt_partitions"),
-    };
-
-    image.vec[3] = (struct write_vec) {
-        .buffer = xmemdup(buffer, t.header->partition_entries * t.dev->sector_size),
-        .block  = t.alt_header->partition_entry_lba,
-        .blocks = partition_sectors(t),
-        .name = xstrdup("alt_gpt_partitions"),
-    };
-
-    buffer = xcalloc(1, t.dev->sector_size);
-    gpt_header_from_host(t.alt_header);
-    memcpy(buffer, t.alt_header, sizeof(*t.alt_header));
-    gpt_header_to_host(t.alt_header);
-
-    image.vec[4] = (struct write_vec) {
-        .buffer = buffer,
-        .block  = t.alt_header->my_lba,
-        .blocks = 1,
-        .name = xstrdup("alt_gpt_header"),
-    };
-
-    return image;
-}
-
-static struct write_vec *find_vec_in_image(struct write_image *image, char *name)
-{
-    for (int i=0; i<image->count; i++)
-        if (strcmp(image->vec[i].name, name) == 0)
-            return &image->vec[i];
-    return NULL;
-}
-
-static struct partition_table table_from_image(struct write_image image, struct device *dev)
-{
-    struct partition_table t = blank_table(dev);
-
-#define find_vec(vec_name, vec_blocks) ({                               \
-            struct write_vec *vec = find_vec_in_image(&image, vec_name); \
-            if (!vec) {                                                 \
-                fprintf(stderr, "Image is missing %s section.\n", vec_name); \
-                free_table(t);                                          \
-                return blank_table(dev);                                \
-            }                                                           \
-            if (vec->blocks != vec_blocks) {                            \
-                fprintf(stderr, "Section %s is %lu blocks instead of %"PRIu64".\n", vec_name, (unsigned long) vec_blocks, vec->blocks); \
-                free_table(t);                                          \
-                return blank_table(dev);                                \
-            }                                                           \
-            vec;                                                        \
-        })
-
-    struct write_vec *mbr                = find_vec("mbr",                1);
-    struct write_vec *gpt_header         = find_vec("gpt_header",         1);
-    struct write_vec *alt_gpt_header     = find_vec("alt_gpt_header",     1);
-
-    t.mbr = mbr_from_sector(mbr->buffer);
-
-    memcpy(t.header, gpt_header->buffer, sizeof(t.header));
-    gpt_header_to_host(t.header);
-
-    memcpy(t.alt_header, alt_gpt_header->buffer, sizeof(t.alt_header));
-    gpt_header_to_host(t.alt_header);
-
-    struct write_vec *gpt_partitions     = find_vec("gpt_partitions",     partition_sectors(t));
-    //struct write_vec *alt_gpt_partitions = find_vec("alt_gpt_partitions", partition_sectors(t));
-
-    free(t.partition); // May be a different length, so reallocate it.
-    t.partition = xmemdup(gpt_partitions->buffer, sizeof(*t.partition) * t.header->partition_entries);
-    gpt_partition_to_host(t.partition, t.header->partition_entries);
-
-    create_mbr_alias_table(&t);
-
-    return t;
-}
-
-void free_image(struct write_image image)
-{
-    for (int i=0; i < image.count; i++) {
-        free(image.vec[i].buffer);
-        free(image.vec[i].name);
-    }
-}
-
-static int export_image(struct write_image image, struct device *dev, char *filename)
-{
-    FILE *info = NULL, *data = NULL;
-    int err = 0;
-    if ((data = fopen(csprintf("%s.data", filename), "wb")) == NULL) { err = errno; warn("Couldn't open %s.data", filename); goto done; }
-    if ((info = fopen(csprintf("%s.info", filename), "w"))  == NULL) { err = errno; warn("Couldn't open %s.info", filename); goto done; }
-
-    fprintf(info, "# sector_size: %ld\n", dev->sector_size);
-    fprintf(info, "# sector_count: %lld\n", dev->sector_count);
-    fprintf(info, "# device: %s\n", dev->name);
-
-    unsigned skip=0;
-    for (int i=0; i < image.count; i++) {
-        int wrote = fwrite(image.vec[i].buffer, dev->sector_size, image.vec[i].blocks, data);
-        if (wrote != image.vec[i].blocks) {
-            err = errno;
-            warn("Couldn't write %s to %s.data", image.vec[i].name, filename);
-            goto done;
+        for (int c=0; c<clients; c++) {
+            struct client *client = &s.client[c];
+            if (!poll_fd[1+c].revents || client->gone)
+                continue;
+            bool alive = true;
+            if (client->out_length)
+                alive = send_response(client);
+            else if (!client->eof && !client->quit && !client->waiting) {
+                char chunk[4096];
+                ssize_t got = read(client->fd, chunk, sizeof(chunk));
+                client->eof = got <= 0; // Run what's already here, then hang up
+                if (got > 0) {
+                    client->buffer = xrealloc(client->buffer, client->length + got + 1);
+                    memcpy(client->buffer + client->length, chunk, got);
+                    client->length += got;
+                    client->buffer[client->length] = '\0';
+                }
+            }
+            client->gone = !alive || !serve_client(&s, client);
         }
-        fprintf(info, "# %s:\ndd if=\"%s.data\" of=\"%s\" bs=%ld skip=%d seek=%lld count=%lld\n",
-                image.vec[i].name,
-                filename, dev->name, dev->sector_size,
-                skip, image.vec[i].block, image.vec[i].blocks);
-        skip += image.vec[i].blocks;
-    }
-
-  done:
-    if (data) fclose(data);
-    if (info) fclose(info);
-    return err;
-}
-
-static int export_table(struct partition_table t, char *filename)
-{
-    struct write_image image = image_from_table(t);
-    int status = export_image(image, t.dev, filename);
-    free_image(image);
-    return status;
-}
-
-int command_export(char **arg)
-{
-    return export_table(g_table, arg[1]);
-}
-command_add("export", command_export, "Save table to a file (not to a device)",
-            command_arg("filename", C_File, "Filename to as a base use for exported files"));
 
-static int import_image(struct write_image *image_out, struct device *dev, char *filename)
-{
-    struct write_image image = { .count = 0 };
-    FILE *info = NULL, *data = NULL;
-    int err = 0;
-    if ((data = fopen(csprintf("%s.data", filename), "rb")) == NULL) { err = errno; warn("Couldn't open %s.data", filename); goto done; }
-    if ((info = fopen(csprintf("%s.info", filename), "r"))  == NULL) { err = errno; warn("Couldn't open %s.info", filename); goto done; }
-
-    unsigned long sector_size=0;
-    unsigned long long sector_count=0;
-    char device[1000]="";
-
-    char line[1000];
-    char section[20];
-
-    while(fgets(line, sizeof(line), info)) {
-        if (!sector_size && sscanf(line, "# sector_size: %ld", &sector_size) == 1 && sector_size != dev->sector_size) {
-            fprintf(stderr, "image file has a sector size of %ld but device %s wants %ld\n", sector_size, dev->name, dev->sector_size);
-            err = EINVAL;
-            goto done;
-        }
-        if (!sector_count && sscanf(line, "# sector_count: %lld", &sector_count) == 1 && sector_count != dev->sector_count) {
-            fprintf(stderr, "image file has %lld LBAs but device %s has %lld\n", sector_count, dev->name, dev->sector_count);
-            err = EINVAL;
-            goto done;
-        }
-        if (!device[0] && sscanf(line, "# device: %1000s", device) == 1 && strcmp(device,dev->name) != 0)
-            fprintf(stderr, "Warning: image file was created from %s but we're operating on %s.\n", device, dev->name);
-        if (sscanf(line, "# %20s:", section) == 1)
-            if (section[0] && section[strlen(section)-1] == ':')
-                section[strlen(section)-1] = '\0';
-        unsigned long long skip, seek;
-        unsigned long count;
-        if (sscanf(line, "dd if=\"%*s of=\"%*s bs=%*d skip=%llu seek=%llu count=%lu", &skip, &seek, &count) == 3) {
-            if (image.count == lengthof(image.vec)) {
-                err = ENOSPC;
-                printf("Too many sections in %s.info\n", filename);
-                goto done;
-            }
-            void *buf = alloc_sectors(dev, count);
-            if (fseek(data, skip*dev->sector_size, SEEK_SET)) {
-                warn("Couldn't seek to %lld in %s.data", skip*dev->sector_size, filename);
-                goto done;
-            }
-            if (fread(buf, dev->sector_size, count, data) != count) {
-                warn("Couldn't read %s from %s.data", section, filename);
-                goto done;
+        for (int c=s.clients-1; c>=0; c--) {
+            struct client *client = &s.client[c];
+            if (client->gone || !client->out_length && !client->waiting && (client->eof || client->quit)) {
+                close(client->fd);
+                free(client->buffer);
+                free(client->out);
+                *client = s.client[--s.clients];
             }
-            image.vec[image.count++] = (struct write_vec) {
-                .buffer = buf,
-                .block  = seek,
-                .blocks = count,
-                .name = xstrdup(section),
-            };
         }
-    }
-
-  done:
-    if (data) fclose(data);
-    if (info) fclose(info);
-    if (!err) *image_out = image;
-    else free_image(image);
-    return err;
-}
-
-int command_import(char **arg)
-{
-    struct write_image image = {};
-    int status = import_image(&image, g_table.dev, arg[1]);
-    for (int i=0; i<image.count; i++)
-        printf(" %d) %20s: %llu @ %llu\n", i, image.vec[i].name, image.vec[i].blocks, image.vec[i].block);
-    struct device *dev = g_table.dev;
-    free_table(g_table);
-    g_table = table_from_image(image, dev);
-    free_image(image);
-    return status;
-}
-command_add("import", command_import, "Load table from a previously exported file",
-            command_arg("filename", C_File, "Base filename to import (don't include .info or .data)"));
-
-static struct write_image image_from_image(struct write_image image, struct device *dev)
-{
-    struct write_image on_disk = image;
-    for (int i=0; i < on_disk.count; i++) {
-        on_disk.vec[i].buffer = get_sectors(dev, on_disk.vec[i].block, on_disk.vec[i].blocks);
-        on_disk.vec[i].name = xstrdup(on_disk.vec[i].name);
-    }
-    return on_disk;
-}
-
-static void dump_data(void *data, size_t length)
-{
-    const unsigned char zero[6/*lines*/ * 16] = { 0 };
-    unsigned char *d = data;
-    for (int i=0; i<length; i+=16) {
-        int chunk=MIN(length,i+16);
 
-        if (length-i >= sizeof(zero) && memcmp(zero, &d[i], sizeof(zero)) == 0) {
-            int zeros=0;
-            for (; i < round_down(length,16) && memcmp(zero, &d[i], 16) == 0; i+=16)
-                zeros += 16;
-            printf("    * Skipped %d zeros\n", zeros);
-            i -= 16;
-            continue;
+        if (poll_fd[0].revents & POLLIN) {
+            int fd = accept(s.listener, NULL, NULL);
+            if (fd == -1)
+                warn("Couldn't accept connection");
+            else {
+                s.client = xrealloc(s.client, sizeof(*s.client) * (s.clients + 1));
+                s.client[s.clients++] = (struct client) { .id = ++s.next_id, .fd = fd, .device = -1 };
+            }
         }
-        
-        printf("  ");
-        for (int j=i; j<chunk; j++)
-            printf("%02x ", d[j]);
-        if (chunk%16)
-            printf("%*s", (16-chunk%16)*3, "");
-        for (int j=i; j<chunk; j++)
-            printf("%c",  isprint(d[j]) ? d[j] : '.');
-        printf("\n");
-    }
-}
-
-static bool table_is_dirty(struct partition_table t)
-{
-    struct write_image image = image_from_table(t);
-    bool dirty = false;
-    for (int i=0; i<image.count; i++) {
-        void *chunk = get_sectors(t.dev, image.vec[i].block, image.vec[i].blocks);
-        if (memcmp(image.vec[i].buffer, chunk, image.vec[i].blocks * t.dev->sector_size) != 0)
-            dirty = true;
-        free(chunk);
     }
-    free_image(image);
-    return dirty;
 }
 
-static int write_table(struct partition_table t, bool force, bool dry_run, bool verbose)
+int main(int c, char **v)
 {
-    char *HOME = getenv("HOME");
-    if (!HOME) {
-        fprintf(stderr, "Couldn't find $HOME environment variable. Punting.\n");
-        if (!force) return ECANCELED;
-    }
-
-    char *dev_name = xstrdup(t.dev->name);
-
-    for (int i=0; dev_name[i]; i++)
-        if (!isalnum(dev_name[i]))
-            dev_name[i] = '_';
-
-    char backup_path[PATH_MAX];
-    snprintf(backup_path, sizeof(backup_path), "%s/.gdisk", HOME);
-    mkdir(backup_path, 0777);
-    sncatprintf(backup_path, sizeof(backup_path), "/backups");
-    mkdir(backup_path, 0777);
-    sncatprintf(backup_path, sizeof(backup_path), "/%s", dev_name);
-    time_t now = time(NULL);
-    strftime(backup_path + strlen(backup_path), sizeof(backup_path) - strlen(backup_path),
-             "-%G-%m-%d-%H-%M-%S", localtime(&now));
-    free(dev_name);
-
-    struct write_image image = image_from_table(t);
-    struct write_image backup = image_from_image(image, t.dev);
-    int status = export_image(backup, t.dev, backup_path);
-    if (status) {
-        warn("Error writing backup of table");
-        if (!force) return ECANCELED;
-    }
-    free_image(backup);
-
-    int err = 0;
-    for (int i=0; i<image.count; i++) {
-        if (dry_run || verbose)
-            printf("Writing %"PRIu64" blocks to LBA %"PRIu64"...\n", image.vec[i].blocks, image.vec[i].block);
-        if (verbose)
-            dump_data(image.vec[i].buffer, image.vec[i].blocks * t.dev->sector_size);
-        if (!dry_run && !device_write(t.dev, image.vec[i].buffer, image.vec[i].block, image.vec[i].blocks)) {
-            err = errno;
-            warn("Error while writing %s to %s", image.vec[i].name, t.dev->name);
-            if (i > 0)
-                fprintf(stderr, "The partition table on your disk is now most likely corrupt.\n");
-            break;
+    char *script_name = NULL;
+    char *types_name = NULL;
+    char *serve_path = NULL;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    static struct option options[] = {
+        { "script", required_argument, NULL, 's' },
+        { "jobs",   required_argument, NULL, 'j' },
+        { "direct", no_argument,       NULL, 'd' },
+        { "io",     required_argument, NULL, 'i' },
+        { "fit",    required_argument, NULL, 'f' },
+        { "align",  required_argument, NULL, 'a' },
+        { "types",  required_argument, NULL, 't' },
+        { "serve",  required_argument, NULL, 'S' },
+        { "help",   no_argument,       NULL, 'h' },
+        { },
+    };
+    for (int opt; (opt = getopt_long(c, v, "s:j:di:f:a:t:S:h", options, NULL)) != -1;)
+        switch (opt) {
+            case 's': script_name = optarg; break;
+            case 'j': jobs = strtol(optarg, NULL, 0); break;
+            case 'd': direct_io = true; break;
+            case 'i': io_backend = optarg; break;
+            case 'f': {
+                int fit = fit_from_string(optarg);
+                if (fit < 0) usage(v[0], 1);
+                default_fit = fit;
+                break;
+            }
+            case 'a':
+                if (strcmp(optarg, "physical") != 0 && strcmp(optarg, "optimal") != 0 && human_size(optarg) <= 0)
+                    usage(v[0], 1);
+                default_align = optarg;
+                break;
+            case 't': types_name = optarg; break;
+            case 'S': serve_path = optarg; break;
+            case 'h': usage(v[0], 0);
+            default:  usage(v[0], 1);
         }
-    }
-    free_image(image);
-    return err;
-}
 
-int command_write(char **arg)
-{
-    int status = write_table(g_table, !!arg[1], !!arg[2], !!arg[3]);
-    if (status == ECANCELED) {
-        status = ENOENT; // ECANCELED will quit the program if we return it.
-        fprintf(stderr, "Table not written because a backup of the existing data could not be made.\n"
-                "Re-run with the --force option to save without a backup.\n");
-    }
+    char **device_name = &v[optind];
+    int devices = c - optind;
+    if (serve_path ? devices || script_name : !devices || devices > 1 && !script_name)
+        usage(v[0], 1);
+    if (jobs < 1)
+        jobs = 1;
+
+    if (types_name) {
+        if (!partition_types_load(types_name))
+            return 1;
+    } else if (getenv("HOME")) {
+        char *default_types;
+        xsprintf(&default_types, "%s/.gdisk/partition-types", getenv("HOME"));
+        if (access(default_types, F_OK) == 0)
+            partition_types_load(default_types);
+        free(default_types);
+    }
+
+    if (serve_path)
+        return serve(serve_path);
+
+    char *script = NULL;
+    if (script_name && !(script = load_script(script_name)))
+        return 1;
+
+    int status = devices == 1 ? process_device(device_name[0], script_name, script)
+                              : process_devices(device_name, devices, jobs, script_name, script);
+    free(script);
     return status;
 }
-command_add("write", command_write, "Write the partition table back to the disk",
-            command_arg("force", C_Flag, "Force table to be written even if backup cannot be saved"),
-            command_arg("dry-run", C_Flag, "Don't write the table, just print what we would do"),
-            command_arg("verbose", C_Flag, "Dump all the data to the screen before writing"));
 
-static char *_p_first_lba(struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("%14"PRId64"", p->first_lba); }
-static char *_p_last_lba (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("%14"PRId64"", p->last_lba); }
-static char *_p_size     (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("%14"PRId64" (%9s)", (p->last_lba - p->first_lba + 1) * dev->sector_size,
-                                                                                                                          human_string((p->last_lba - p->first_lba + 1) * dev->sector_size)); }
-static char *_p_guid     (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dstrdup(guid_str(p->partition_guid)); }
-static char *_p_flags    (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("implement_me"); }
-static char *_p_boot     (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return !m ? "" : dsprintf("%s", m->status & MBR_STATUS_BOOTABLE ? "*" : ""); }
-static char *_p_mbr_type (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return !m ? "" : dsprintf("%02x", m->partition_type); }
-static char *_p_gpt_type (struct gpt_partition *p, struct mbr_partition *m, struct device *dev)
-{
-    char *string = NULL;
-    for (int t=0; gpt_partition_type[t].name; t++)
-        if (guid_eq(gpt_partition_type[t].guid, p->partition_type))
-            string = xstrcat(string, dsprintf("%s%s", string ? " or " : "", gpt_partition_type[t].name));
-    if (!string)
-        return guid_str(p->partition_type);
-    return dalloc_remember(string);
-}
-static char *_p_gpt_label(struct gpt_partition *p, struct mbr_partition *m, struct device *dev)
+static int help(struct partition_table *t, char **arg)
 {
-    wchar_t name[36];
-    for (int i=0; i<lengthof(name); i++)
-        name[i] = p->name[i];
-    return dsprintf("%.36ls", name);
-}
-
-static int command_print(char **arg)
-{
-    bool verbose = !!arg[1];
-    dalloc_start();
-    printf("%s:\n", g_table.dev->name);
-    printf("  Disk GUID: %s\n", guid_str(g_table.header->disk_guid));
-    printf("  %lld %ld byte sectors for %lld total bytes (%s capacity)\n",
-           g_table.dev->sector_count,  g_table.dev->sector_size,
-           g_table.dev->sector_count * g_table.dev->sector_size,
-           human_string(g_table.dev->sector_count * g_table.dev->sector_size));
-    printf("  MBR partition table is %s synced to the GPT table\n", g_table.options.mbr_sync ? "currently" : "not");
-    printf("\n");
-
-    struct printer {
-        char *title;
-        bool right;
-        bool verbose;
-        char *(*print)(struct gpt_partition *p, struct mbr_partition *m, struct device *dev);
-    };
-    struct printer set[] = {
-        { .title="Start LBA", .print= _p_first_lba, .verbose=true, .right = true, },
-        { .title="End LBA",   .print= _p_last_lba,  .verbose=true, .right = true, },
-        { .title="Size",      .print= _p_size,                     .right = true, },
-        { .title="GUID",      .print= _p_guid,      .verbose=true, },
-        { .title="Flags",     .print= _p_flags,     },
-        { .title="B",         .print= _p_boot,      },
-        { .title="MBR",       .print= _p_mbr_type,  },
-        { .title="GPT Type",  .print= _p_gpt_type,  },
-        { .title="Label",     .print= _p_gpt_label, },
-    };
-
-    struct {
-        int width;
-        char *data[g_table.header->partition_entries];
-    } column[lengthof(set)];
-    memset(column, 0, sizeof(column));
-
-    for (int p=0; p<g_table.header->partition_entries; p++) {
-        if (guid_eq(gpt_partition_type_empty, g_table.partition[p].partition_type))
-            continue;
-        for (int c=0; c<lengthof(set); c++) {
-            if (set[c].verbose && !verbose) continue;
-            int m = get_mbr_alias(g_table, p);
-            column[c].data[p] = set[c].print(&g_table.partition[p],
-                                             g_table.options.mbr_sync && m != -1 ? &g_table.mbr.partition[m] : NULL,
-                                             g_table.dev);
-            if (!column[c].width) column[c].width = strlen(set[c].title);
-            column[c].width = MAX(column[c].width, strlen(column[c].data[p]));
+    if (arg[1]) {
+        struct command *c = find_command(arg[1]);
+        if (!c) {
+            printf("No such command: '%s'\n", arg[1]);
+            return 0;
         }
-    }
-
-#define format(x) ( set[x].right ? "%*s  " : "%-*s  " )
-
-    printf("  ###  ");
-    for (int c=0; c<lengthof(set); c++)
-        if (!set[c].verbose || verbose)
-            printf(format(c), column[c].width, set[c].title);
-    printf("\n");
-    printf("  -----");
-    for (int c=0; c<lengthof(set); c++)
-        if (!set[c].verbose || verbose)
-            printf("%.*s--", column[c].width, "----------------------------------------------------------------------------------------------------------------");
-    printf("\n");
-    for (int p=0; p<g_table.header->partition_entries; p++) {
-        if (!column[2].data[p]) continue;
-        printf("  %3d) ", p);
-        for (int c=0; c<lengthof(set); c++)
-            if (!set[c].verbose || verbose)
-                printf(format(c), column[c].width, column[c].data[p]);
-        printf("\n");
-    }
-    dalloc_free();
-    return 0;
-}
-command_add("print", command_print, "Print the partition table.",
-            command_arg("verbose", C_Flag, "Print more details"));
-
-static int command_print_mbr(char **arg)
-{
-    int verbose = !!arg[1];
-    printf("    #) %-9s", "Flags");
-    if (verbose) printf(" %-11s %-11s", "Start C:H:S", "End C:H:S");
-    printf(" %10s %22s %s\n", "Start LBA", "Size", "Type");
-    printf("    %.*s\n", verbose ? 98 : 78, "----------------------------------------------------------------------------------------------------------------");
-    for (int i=0; i<lengthof(g_table.mbr.partition); i++) {
-        if (!g_table.mbr.partition[i].partition_type) {
-            printf("    %d) Unused entry\n", i);
-            continue;
+        printf("%s:\n  %s\n\nUsage:\n  %s", c->name, c->help, c->name);
+        for (int a=0; c->arg[a].name; a++) {
+            printf(" %s%s%s",
+                   c->arg[a].type & C_Optional ? "[ " : "",
+                   arg_name(&c->arg[a]),
+                   c->arg[a].type & C_Optional ? " ]" : "");
         }
-
-        printf("    %d) %02x %6s",
-                   i, g_table.mbr.partition[i].status, g_table.mbr.partition[i].status & MBR_STATUS_BOOTABLE ? "(boot)" : "");
-        if (verbose)
-            printf(" %4u:%03u:%02u %4u:%03u:%02u",
-                   g_table.mbr.partition[i].first_sector.cylinder, g_table.mbr.partition[i].first_sector.head, g_table.mbr.partition[i].first_sector.sector,
-                   g_table.mbr.partition[i].last_sector.cylinder,  g_table.mbr.partition[i].last_sector.head,  g_table.mbr.partition[i].last_sector.sector);
-        printf(" %10u %10u (%9s) %02x (%s)\n",
-                   g_table.mbr.partition[i].first_sector_lba,
-                   g_table.mbr.partition[i].sectors, human_string((long long)g_table.mbr.partition[i].sectors * g_table.dev->sector_size),
-                   g_table.mbr.partition[i].partition_type,
-                   mbr_partition_type[g_table.mbr.partition[i].partition_type] ? mbr_partition_type[g_table.mbr.partition[i].partition_type] : "???");
+        printf("\n\nArguments:\n");
+        for (int a=0; c->arg[a].name; a++) {
+            printf("  %s: %s\n", arg_name(&c->arg[a]), c->arg[a].help);
+        }
+        return 0;
     }
-    return 0;
-}
-command_add("print-mbr", command_print_mbr, "Print the MBR partition table.",
-            command_arg("verbose", C_Flag, "Include extra cylinder/head/sector information in output"));
-
-static void dump_dev(struct device *dev)
-{
-    printf("dev.sector_size: %ld\n", dev->sector_size);
-    printf("dev.sector_count: %lld\n", dev->sector_count);
-}
 
-static int command_dump_dev(char **arg)
-{
-    dump_dev(g_table.dev);
-    return 0;
-}
-command_add("debug-dump-dev", command_dump_dev, "Dump device structure");
+    printf("Commands:\n");
+    int count;
+    struct command **command = command_list(&count);
+    int width=0;
+    for (int c=0; c<count; c++)
+        width=MAX(width, strlen(command[c]->name));
 
-static void dump_header(struct gpt_header *header)
-{
-    printf("signature[8]         = %.8s\n", header->signature);
-    printf("revision             = %08x\n", header->revision);
-    printf("header_size          = %u\n",   header->header_size);
-    printf("header_crc32         = %08x\n", header->header_crc32);
-    printf("reserved             = %08x\n", header->reserved);
-    printf("my_lba               = %"PRIu64"\n", header->my_lba);
-    printf("alternate_lba        = %"PRIu64"\n", header->alternate_lba);
-    printf("first_usable_lba     = %"PRIu64"\n", header->first_usable_lba);
-    printf("last_usable_lba      = %"PRIu64"\n", header->last_usable_lba);
-    printf("disk_guid            = %s\n",   guid_str(header->disk_guid));
-    printf("partition_entry_lba  = %"PRIu64"\n", header->partition_entry_lba);
-    printf("partition_entries    = %u\n",   header->partition_entries);
-    printf("partition_entry_size = %u\n",   header->partition_entry_size);
-    printf("partition_crc32      = %08x\n", header->partition_crc32);
-}
+    for (int c=0; c<count; c++)
+        printf("%-*s %s\n", width+2, command[c]->name, command[c]->help);
 
-static int command_dump_header(char **arg)
-{
-    dump_header(arg[1] ? g_table.alt_header : g_table.header);
     return 0;
 }
-command_add("debug-dump-gpt-header", command_dump_header, "Dump GPT header structure",
-            command_arg("alt", C_Flag, "Display the alternate partition header"));
+command_add("help", help, "Show a list of commands",
+            command_arg("command", C_String|C_Optional, "Command to get help with"));
 
-static void dump_partition(struct gpt_partition *p)
+static int quit(struct partition_table *t, char **arg)
 {
-    printf("partition_type = %s\n",   guid_str(p->partition_type));
-    for (int i=0; gpt_partition_type[i].name; i++)
-        if (guid_eq(gpt_partition_type[i].guid, p->partition_type))
-            printf("      * %s\n", gpt_partition_type[i].name);
-    printf("partition_guid = %s\n",   guid_str(p->partition_guid));
-    printf("first_lba      = %"PRId64"\n", p->first_lba);
-    printf("last_lba       = %"PRId64"\n",  p->last_lba);
-    printf("attributes     = %016"PRIx64"\n", p->attributes);
-    wchar_t name[36];
-    for (int i=0; i<lengthof(name); i++)
-        name[i] = p->name[i];
-    printf("name[36]       = %.36ls\n",   name);
+    return ECANCELED; // total special case. Weak.
 }
+command_add("quit", quit, "Quit, leaving the disk untouched.");
 
-static int command_dump_partition(char **arg)
+static char *command_completion(const char *text, int state)
 {
-    for (int i=0; i<g_table.header->partition_entries; i++) {
-        if (guid_eq(gpt_partition_type_empty, g_table.partition[i].partition_type))
-            continue;
-        printf("Partition %d of %d\n", i, g_table.header->partition_entries);
-        dump_partition(&g_table.partition[i]);
+    int count;
+    struct command **command = command_list(&count);
+    // Binary search for the first name >= text. The matches are the run of names starting there.
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(command[mid]->name, text) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return 0;
-}
-command_add("debug-dump-partition", command_dump_partition, "Dump partitions structure");
-
-static int command_dump_mbr(char **arg)
-{
-    dump_mbr(g_table.mbr);
-    return 0;
-}
-command_add("debug-dump-mbr", command_dump_mbr, "Dump MBR structure");
-
-// Some useful library routines. Should maybe go in another file at some point.
-
-static size_t sncatprintf(char *buffer, size_t space, char *format, ...)
-{
-    va_list ap;
-    va_start(ap, format);
-    size_t length = strlen(buffer);
-    int count = vsnprintf(buffer + length, space - length, format, ap);
-    va_end(ap);
-    return count;
+    if (lo + state < count && strncmp(text, command[lo + state]->name, strlen(text)) == 0)
+        return xstrdup(command[lo + state]->name);
+    return NULL;
 }
 
-static char *tr(char *in, char *from, char *to)
+static char *partition_size_completion(const char *text, int state)
 {
-    char *out = in;
-    for (int i=0; out[i]; i++) {
-        char *c = strchr(from, out[i]);
-        if (c) out[i] = to[c-from];
+    struct partition_table *t = completion_table;
+    struct free_space space;
+    for (int cursor=0, s=0; next_free_space(t, &cursor, &space); ) {
+        char *_size = NULL; asprintf(&_size, "%"PRId64, space.blocks * t->dev->sector_size);
+        if (strncasecmp(text, _size, strlen(text)) == 0 && s++ == state)
+            return _size;
+        free(_size);
     }
-    return out;
-}
-
-static char *trdup(char *in, char *from, char *to)
-{
-    return tr(xstrdup(in), from, to);
-}
-
-static char *ctr(char *in, char *from, char *to)
-{
-    return tr(csprintf("%s", in), from, to);
+    return NULL;
 }
 
-static char *trim(char *s)
+static char *partition_type_completion(const char *text, int state)
 {
-    while (isspace(*s)) s++;
-    char *e = s+strlen(s) - 1;
-    while (e >= s && isspace(*e))
-        *e-- = '\0';
-    return s;
+    char *name = partition_type_completion_name(text, state);
+    return name ? xstrdup(name) : NULL;
 }
@@ -2,6 +2,9 @@
 #ifndef __GDISK_H__
 #define __GDISK_H__
 
+// Where "new" puts a partition when there's a choice of free spaces.
+enum fit { Fit_First, Fit_Best, Fit_Worst, Fit_End };
+
 struct partition_table {
     struct device *dev;
     struct gpt_header *header;
@@ -11,12 +14,19 @@ struct partition_table {
     struct options {
         bool mbr_sync;
     } options;
+    struct settings {          // Defaults for "new". Carried over when the whole table gets replaced.
+        enum fit fit;
+        char *align;
+    } settings;
     int alias[lengthof(((struct mbr*)0)->partition)];
+    unsigned generation;       // Bumped by every change to the table.
+    unsigned clean_generation; // The generation that matches what's on the disk.
+    struct entry_crc *entry_crc; // Cached per-entry CRCs. NULL until the first update_table_crc().
+    struct extents *extents;     // Used space, sorted. NULL until the first free space query.
+    bool crc_stale;              // The header CRCs need recomputing (see update_table_crc()).
+    bool aliases_stale;          // alias[] and options.mbr_sync need recomputing from the MBR.
 };
 
-// This is how you get to anything good.
-extern struct partition_table g_table;
-
 struct command_arg_ {
     char *name;
     int type;
@@ -24,7 +34,7 @@ struct command_arg_ {
 };
 struct command {
     char *name;
-    int (*handler)(char **arg);
+    int (*handler)(struct partition_table *t, char **arg);
     char *help;
     struct command_arg_ *arg;
 };
@@ -39,14 +49,50 @@ struct command {
 #define C_Partition_Type 0x05
 #define C_FreeSpace 0x06
 
-#include "autolist.h"
+// table.c
+int read_table(struct device *dev, struct partition_table *t); // 0, or an errno (after complaining) if the device can't be read
+// Opens the device |name| and reads its table, like read_table(). |t|->dev is the device, for close_device() when done.
+int open_table(char *name, bool direct_io, char *backend, struct partition_table *t);
+void free_table(struct partition_table *t);
+bool table_is_dirty(struct partition_table *t);
+struct gpt_partition *find_unused_partition(struct partition_table *t);
+int fit_from_string(char *s);
+struct free_space {
+    uint64_t first_lba;
+    uint64_t blocks;
+};
+bool next_free_space(struct partition_table *t, int *cursor, struct free_space *space);
+
+// command.c
+// Asks for a missing argument. Returns a malloc()ed answer or NULL if there isn't one.
+typedef char *(*command_prompt)(struct command *c, struct command_arg_ *arg);
+struct command *find_command(char *command);
+struct command **command_list(int *count); // Sorted by name
+char *arg_name(struct command_arg_ *arg);
+// Runs |line| on |t|. Missing arguments are asked for with |prompt| (or are errors if it's NULL). If |final_line| isn't
+// NULL it gets a malloc()ed copy of the line with the answers added.
+int run_command(struct partition_table *t, char *line, char **final_line, command_prompt prompt);
+int call_command(struct partition_table *t, char *name, char **arg, int args);
+char *trim(char *s);
+
+#include "cat.h"
+// Commands get collected by the linker: command_add() drops a pointer to each one into its own section and the
+// section start and stop symbols give us the whole array without any code running at startup.
+#if defined(__APPLE__)
+#define COMMAND_SECTION "__DATA,gdisk_command"
+extern struct command *const __start_gdisk_command[] __asm("section$start$__DATA$gdisk_command");
+extern struct command *const __stop_gdisk_command[]  __asm("section$end$__DATA$gdisk_command");
+#else
+#define COMMAND_SECTION "gdisk_command"
+extern struct command *const __start_gdisk_command[];
+extern struct command *const __stop_gdisk_command[];
+#endif
+
 #define command_arg(name, type, help) { name, type, help }
 #define command_add(name, handler, help, ...) \
     static struct command_arg_ Unique(__command_arg__)[] = { command_arg(NULL, 0, NULL), ##__VA_ARGS__, command_arg(NULL, 0, NULL) }; \
     static struct command Unique(__command__) = { name, handler, help, &Unique(__command_arg__)[1] }; \
-    autolist_add(command, &Unique(__command__))
-
-autolist_declare(struct command *, command);
+    static struct command *const Unique(__command_ptr__) __attribute__((used, section(COMMAND_SECTION), aligned(sizeof(void *)))) = &Unique(__command__)
 
 #endif /* __GDISK_H__ */
 
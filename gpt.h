@@ -73,26 +73,57 @@ static inline void gpt_partition_to_host(struct gpt_partition *partition, int en
 #define gpt_partition_from_host gpt_partition_to_host
 #define gpt_header_from_host    gpt_header_to_host
 
-#include <zlib.h>
+// Copy into on-disk (little endian) byte order, leaving the original alone. On little endian machines these are just
+// memcpy()s.
+#include <string.h>
+static inline void gpt_header_to_disk(struct gpt_header *disk, const struct gpt_header *h)
+{
+    *disk = *h;
+    gpt_header_from_host(disk);
+}
+
+static inline void gpt_partition_to_disk(struct gpt_partition *disk, const struct gpt_partition *partition, int entries)
+{
+    memcpy(disk, partition, sizeof(*partition) * entries);
+    gpt_partition_from_host(disk, entries);
+}
+
+#include "crc32.h"
+
+static inline uint32_t gpt_partition_crc32(const struct gpt_header *h, const struct gpt_partition *partition)
+{
+#if BYTE_ORDER == LITTLE_ENDIAN
+    // The entries in memory are already exactly what's on the disk.
+    return gpt_crc32(0, (void*)partition, h->partition_entries * h->partition_entry_size);
+#else
+    uint32_t crc = 0;
+    for (int p=0; p<h->partition_entries; p++) {
+        struct gpt_partition disk;
+        gpt_partition_to_disk(&disk, &partition[p], 1);
+        crc = gpt_crc32(crc, (void*)&disk, sizeof(disk));
+    }
+    return crc;
+#endif
+}
 
-static inline uint32_t gpt_partition_crc32(struct gpt_header *h, struct gpt_partition *partition)
+// The CRC of one partition entry on its own, as it would be laid out on the disk.
+static inline uint32_t gpt_partition_entry_crc32(const struct gpt_header *h, const struct gpt_partition *partition)
 {
-    uint32_t partition_crc32_old = h->partition_crc32; h->partition_crc32 = 0;
-    gpt_partition_from_host(partition, h->partition_entries);
-    uint32_t partition_crc32 = crc32(crc32(0L, Z_NULL, 0), (void*)partition, h->partition_entries * h->partition_entry_size);
-    gpt_partition_to_host(partition, h->partition_entries);
-    h->partition_crc32 = partition_crc32_old;
-    return partition_crc32;
+#if BYTE_ORDER == LITTLE_ENDIAN
+    return gpt_crc32(0, (void*)partition, h->partition_entry_size);
+#else
+    struct gpt_partition disk;
+    gpt_partition_to_disk(&disk, partition, 1);
+    return gpt_crc32(0, (void*)&disk, sizeof(disk));
+#endif
 }
 
-static inline uint32_t gpt_header_crc32(struct gpt_header *h)
+static inline uint32_t gpt_header_crc32(const struct gpt_header *h)
 {
-    uint32_t headder_crc32_old = h->header_crc32; h->header_crc32 = 0;
-    gpt_header_from_host(h);
-    uint32_t header_crc32 = crc32(crc32(0L, Z_NULL, 0), (void*)h, h->header_size);
-    gpt_header_to_host(h);
-    h->header_crc32 = headder_crc32_old;
-    return header_crc32;
+    struct gpt_header disk;
+    gpt_header_to_disk(&disk, h);
+    disk.header_crc32 = 0;
+    return gpt_crc32(0, (void*)&disk, h->header_size < sizeof(disk) ? h->header_size : sizeof(disk));
 }
 
 
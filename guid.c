@@ -2,55 +2,101 @@
 
 #include "guid.h"
 
-#include <stdio.h>
-char *guid_str(GUID g)
+#include <stdint.h>
+#include <stdbool.h>
+
+// Where each byte's 2 hex digits go in "00112233-4455-6677-8899-aabbccddeeff" form. The first 3 fields are little endian.
+static const uint8_t text_offset[16] = { 6, 4, 2, 0,  11, 9,  16, 14,  19, 21,  24, 26, 28, 30, 32, 34 };
+static const uint8_t dash_offset[4]  = { 8, 13, 18, 23 };
+
+char *guid_format(char *str, GUID g)
 {
-    // Obviously not thread safe, but convenient. Don't use 2 in the same print. :-)
-    static char str[sizeof(GUID)*2+4+1]; // four '-'s and a null
-    snprintf(str, sizeof(str), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-             g.byte[3], g.byte[2], g.byte[1], g.byte[0],
-             g.byte[5], g.byte[4],
-             g.byte[7], g.byte[6],
-             g.byte[8], g.byte[9],
-             g.byte[10], g.byte[11], g.byte[12], g.byte[13], g.byte[14], g.byte[15]);
+    static const char hex[] = "0123456789abcdef";
+    for (int i=0; i<sizeof(g.byte); i++) {
+        str[text_offset[i]+0] = hex[g.byte[i] >> 4];
+        str[text_offset[i]+1] = hex[g.byte[i] & 0xf];
+    }
+    for (int d=0; d<sizeof(dash_offset); d++)
+        str[dash_offset[d]] = '-';
+    str[GUID_STR_SIZE-1] = '\0';
     return str;
 }
 
 // This GUID isn't "bad" per-se, but since GUIDs are globally unique I hereby designate this one to represent unparsable GUID strings.
 GUID bad_guid = STATIC_GUID(a3805766,111e,11de,9b0f,001cc0952d53);
 
-#include <stdlib.h>
-#include <ctype.h>
+// -1 for anything that isn't a hex digit, so OR-ing all the lookups together says if any of them were bad.
+static const int8_t hex_value[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    ['a'] = 10, 11, 12, 13, 14, 15,
+    ['A'] = 10, 11, 12, 13, 14, 15,
+};
+
+static bool decode(GUID *g, const char *s, const uint8_t *offset)
+{
+    int bad = 0;
+    for (int i=0; i<sizeof(g->byte); i++) {
+        int hi = hex_value[(unsigned char)s[offset[i]+0]],
+            lo = hex_value[(unsigned char)s[offset[i]+1]];
+        bad |= hi | lo;
+        g->byte[i] = hi << 4 | lo;
+    }
+    return bad >= 0;
+}
+
 GUID guid_from_string(char *guid)
 {
+    static const uint8_t stream_offset[16] = { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30 };
     GUID g;
-    if (strlen(guid) == 32) { // hex stream
-        for (int i=0; i<16; i++) {
-            char hex[3] = { guid[i*2+0], guid[i*2+1] };
-            if (!isxdigit(hex[0]) || !isxdigit(hex[1]))
-                return bad_guid;
-            g.byte[i] = strtoul(hex, NULL, 16);
-        }
-        return g;
+    size_t length = strlen(guid);
+    if (length == 32) // hex stream
+        return decode(&g, guid, stream_offset) ? g : bad_guid;
+    if (length != GUID_STR_SIZE-1)
+        return bad_guid;
+    for (int d=0; d<sizeof(dash_offset); d++)
+        if (guid[dash_offset[d]] != '-')
+            return bad_guid;
+    return decode(&g, guid, text_offset) ? g : bad_guid;
+}
+
+#include <errno.h>
+#include <err.h>
+#if defined(__APPLE__)
+#include <stdlib.h>
+static bool random_bytes(void *buffer, size_t length) { arc4random_buf(buffer, length); return true; }
+#else
+#include <sys/random.h>
+static bool random_bytes(void *buffer, size_t length)
+{
+    // One call unless a signal interrupts a big request part way through.
+    for (ssize_t got; length; buffer = (char *)buffer + got, length -= got)
+        if ((got = getrandom(buffer, length, 0)) < 0 && errno != EINTR)
+            return false;
+        else if (got < 0)
+            got = 0;
+    return true;
+}
+#endif
+
+bool guid_create_batch(GUID *g, size_t count)
+{
+    if (!random_bytes(g, sizeof(*g) * count)) {
+        int error = errno;
+        warn("Couldn't get random bytes for %zu GUIDs", count);
+        errno = error;
+        return false;
     }
-    int byte[16];
-    if (sscanf(guid, "%2x%2x%2x%2x-%2x%2x-%2x%2x-%2x%2x-%2x%2x%2x%2x%2x%2x",
-               &byte[3], &byte[2], &byte[1], &byte[0],
-               &byte[5], &byte[4],
-               &byte[7], &byte[6],
-               &byte[8], &byte[9],
-               &byte[10], &byte[11], &byte[12], &byte[13], &byte[14], &byte[15]) == 16) {
-        for (int i=0; i<16; i++)
-            g.byte[i] = byte[i];
-        return g;
+    // RFC 4122 version 4 (random). Bytes 6 and 7 are the little endian 3rd field, so the version lives in the top of 7.
+    for (size_t i=0; i<count; i++) {
+        g[i].byte[7] = (g[i].byte[7] & 0x0f) | 0x40;
+        g[i].byte[8] = (g[i].byte[8] & 0x3f) | 0x80;
     }
-    return bad_guid;
+    return true;
 }
 
-#include <uuid/uuid.h>
 GUID guid_create()
 {
     GUID g;
-    uuid_generate(g.byte);
-    return g;
+    return guid_create_batch(&g, 1) ? g : bad_guid;
 }
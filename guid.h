@@ -2,6 +2,9 @@
 #ifndef __GUID_H__
 #define __GUID_H__
 
+#include <stddef.h>
+#include <stdbool.h>
+
 typedef struct GUID {
     unsigned char byte[16];
 } GUID;
@@ -31,11 +34,14 @@ extern GUID bad_guid;
         _0x(e) >>  0 & 0xff                     \
      } }
 
-char *guid_str(); // convenience function. Returns a static char, so strdup before calling
-                  // again. Obviously not thread safe, but it's convenient. :-)
+#define GUID_STR_SIZE (sizeof(GUID)*2+4+1) // four '-'s and a null
+char *guid_format(char *str, GUID g); // Writes the GUID into str (GUID_STR_SIZE bytes) and returns it.
+// Convenience version for printf()s and such. The buffer lasts until the end of the caller's block.
+#define guid_str(g) guid_format((char[GUID_STR_SIZE]){}, (g))
 
 GUID guid_from_string(char *guid);
-GUID guid_create();
+GUID guid_create(); // bad_guid (with errno set) if there's no randomness to be had
+bool guid_create_batch(GUID *g, size_t count); // Fills in |count| new random GUIDs with a single trip to the kernel.
 
 #include <string.h>
 static inline int guid_eq(GUID a, GUID b) { return memcmp(a.byte, b.byte, sizeof(a.byte)) == 0; }
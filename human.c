@@ -4,7 +4,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include "csprintf.h"
 #include "human.h"
 
 float human_number(long long x)
@@ -23,9 +22,10 @@ char *human_units(long long x)
             return *u;
 }
 
-char *human_string(long long size)
+char *human_string_format(char *str, long long size)
 {
-    return csprintf("%.2f %2s", human_format(size));
+    snprintf(str, HUMAN_STR_SIZE, "%.2f %2s", human_format(size));
+    return str;
 }
 
 long long human_units_multiplier(char *unit)
@@ -53,7 +53,7 @@ long long human_size(char *human)
 }
 
 #ifdef TEST
-// gcc -std=gnu99 -o human-test human.c csprintf.c -DTEST
+// gcc -std=gnu99 -o human-test human.c -DTEST
 #include <inttypes.h>
 int main()
 {
@@ -3,7 +3,11 @@
 #define __HUMAN_H__
 
 // Main interface
-char *human_string(long long size); // csprintf() based.
+// human_string() formats into a buffer that lasts until the end of the caller's block, so it's fine to use several
+// in one printf(), or from several threads. Keep a copy of the result if it needs to live longer.
+#define HUMAN_STR_SIZE 16 // "1023.99 EB" and a null, with room to spare
+#define human_string(size) human_string_format((char[HUMAN_STR_SIZE]){}, (size))
+char *human_string_format(char *str, long long size); // Writes into str (HUMAN_STR_SIZE bytes) and returns it.
 long long human_size(char *human);
 
 
@@ -0,0 +1,188 @@
+// Copyright © 2008-2024 David Caldwell <david@porkrind.org>
+
+// The library interface. Each handle is a struct partition_table and the functions are thin wrappers around the
+// commands, so the library and gdisk can't drift apart.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <err.h>
+#include "lengthof.h"
+#include "guid.h"
+#include "partition-type.h"
+#include "device.h"
+#include "gpt.h"
+#include "mbr.h"
+#include "human.h"
+#include "xmem.h"
+#include "dalloc.h"
+#include "gdisk.h"
+#include "libgdisk.h"
+
+struct gdisk {
+    struct partition_table table;
+    char *align; // table.settings.align points here
+};
+
+struct gdisk *gdisk_open(const char *device, const struct gdisk_options *options)
+{
+    struct gdisk_options defaults = {};
+    if (!options)
+        options = &defaults;
+    int fit = options->fit ? fit_from_string((char *)options->fit) : Fit_First;
+    if (fit < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    char *align = (char *)(options->align ? options->align : "1M");
+    if (strcmp(align, "physical") != 0 && strcmp(align, "optimal") != 0 && human_size(align) <= 0) {
+        warnx("Bad alignment: \"%s\"", align);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct gdisk *g = xcalloc(1, sizeof(*g));
+    int error = open_table((char *)device, options->direct_io, (char *)options->io, &g->table);
+    if (error) {
+        free(g);
+        errno = error;
+        return NULL;
+    }
+    g->align = xstrdup(align);
+    g->table.settings = (struct settings) { .fit = fit, .align = g->align };
+    return g;
+}
+
+void gdisk_close(struct gdisk *g)
+{
+    struct device *dev = g->table.dev;
+    free_table(&g->table);
+    close_device(dev);
+    free(g->align);
+    free(g);
+}
+
+int gdisk_read(struct gdisk *g)
+{
+    struct device *dev = g->table.dev;
+    struct settings settings = g->table.settings;
+    struct partition_table table;
+    int error = read_table(dev, &table);
+    if (error)
+        return error; // Keep what we had
+    free_table(&g->table);
+    g->table = table;
+    g->table.settings = settings;
+    return 0;
+}
+
+bool gdisk_dirty(struct gdisk *g)
+{
+    return table_is_dirty(&g->table);
+}
+
+int gdisk_sector_size(struct gdisk *g)
+{
+    return g->table.dev->sector_size;
+}
+
+int gdisk_partition_entries(struct gdisk *g)
+{
+    return g->table.header->partition_entries;
+}
+
+// Partition names are UTF-16LE (as host order uint16_ts by now), NUL padded.
+static void utf8_from_utf16(char *utf8, const uint16_t *utf16, int n)
+{
+    for (int i=0; i<n && utf16[i]; i++) {
+        uint32_t c = utf16[i];
+        if (c >= 0xd800 && c < 0xdc00 && i+1 < n && utf16[i+1] >= 0xdc00 && utf16[i+1] < 0xe000)
+            c = 0x10000 + ((c - 0xd800) << 10 | (utf16[++i] - 0xdc00));
+        else if (c >= 0xd800 && c < 0xe000)
+            c = 0xfffd; // Unpaired surrogate
+        if (c < 0x80)
+            *utf8++ = c;
+        else if (c < 0x800) {
+            *utf8++ = 0xc0 | c >> 6;
+            *utf8++ = 0x80 | c       & 0x3f;
+        } else if (c < 0x10000) {
+            *utf8++ = 0xe0 | c >> 12;
+            *utf8++ = 0x80 | c >>  6 & 0x3f;
+            *utf8++ = 0x80 | c       & 0x3f;
+        } else {
+            *utf8++ = 0xf0 | c >> 18;
+            *utf8++ = 0x80 | c >> 12 & 0x3f;
+            *utf8++ = 0x80 | c >>  6 & 0x3f;
+            *utf8++ = 0x80 | c       & 0x3f;
+        }
+    }
+    *utf8 = '\0';
+}
+
+int gdisk_partition(struct gdisk *g, int index, struct gdisk_partition *p)
+{
+    if (index < 0 || index >= g->table.header->partition_entries)
+        return EINVAL;
+    struct gpt_partition *part = &g->table.partition[index];
+    if (guid_eq(gpt_partition_type_empty, part->partition_type))
+        return ENOENT;
+    guid_format(p->type, part->partition_type);
+    p->type_name = partition_type_names(part->partition_type);
+    guid_format(p->guid, part->partition_guid);
+    p->first_lba  = part->first_lba;
+    p->last_lba   = part->last_lba;
+    p->attributes = part->attributes;
+    utf8_from_utf16(p->label, part->name, lengthof(part->name));
+    return 0;
+}
+
+int gdisk_clear(struct gdisk *g)
+{
+    return call_command(&g->table, "clear-table", NULL, 0);
+}
+
+int gdisk_create(struct gdisk *g, const char *type, uint64_t size, const char *label, int *index)
+{
+    struct gpt_partition *p = find_unused_partition(&g->table); // The one "new" will use
+    char size_string[24];
+    snprintf(size_string, sizeof(size_string), "%"PRIu64, size);
+    int status = call_command(&g->table, "new", (char *[]) { (char *)type, size_string, (char *)label }, 3);
+    if (!status && index)
+        *index = p - g->table.partition;
+    return status;
+}
+
+int gdisk_delete(struct gdisk *g, int index)
+{
+    char index_string[16];
+    snprintf(index_string, sizeof(index_string), "%d", index);
+    return call_command(&g->table, "delete", (char *[]) { index_string }, 1);
+}
+
+int gdisk_edit(struct gdisk *g, int index, const char *type, const char *label, const char *guid)
+{
+    char index_string[16];
+    snprintf(index_string, sizeof(index_string), "%d", index);
+    return call_command(&g->table, "edit", (char *[]) { index_string, (char *)type, (char *)label, (char *)guid }, 4);
+}
+
+int gdisk_write(struct gdisk *g, bool force)
+{
+    return call_command(&g->table, "write", (char *[]) { force ? "--force" : NULL }, 1);
+}
+
+int gdisk_load_types(const char *path)
+{
+    return partition_types_load((char *)path) ? 0 : EINVAL;
+}
+
+int gdisk_run(struct gdisk *g, const char *command)
+{
+    char *line = xstrdup((char *)command);
+    int status = run_command(&g->table, line, NULL, NULL);
+    free(line);
+    return status;
+}
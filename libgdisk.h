@@ -0,0 +1,61 @@
+// Copyright © 2008-2024 David Caldwell <david@porkrind.org>
+#ifndef __LIBGDISK_H__
+#define __LIBGDISK_H__
+
+// libgdisk is gdisk's partition table code without the command line around it. A struct gdisk is one open device
+// and its partition table, including any changes that haven't been written yet. Handles don't share anything, so
+// different threads can drive different handles at once (but not the same one).
+//
+// Functions that can fail return 0 or an errno value, like gdisk's commands. They complain on stderr, and the ones that
+// are gdisk commands underneath print what the command would print.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The library is built with everything hidden, so these are all it exports.
+#define GDISK_API __attribute__((visibility("default")))
+
+struct gdisk;
+
+struct gdisk_options {
+    bool direct_io;    // Bypass the page cache
+    const char *io;    // I/O backend: "sync" or (on Linux) "io_uring". NULL picks the fastest one that works.
+    const char *fit;   // Where new partitions go by default: "first", "best", "worst" or "end". NULL means "first".
+    const char *align; // What new partitions are aligned to by default, like "1M", "physical" or "optimal". NULL means "1M".
+};
+
+// Opens |device| (a disk or an image file) and reads its table. |options| can be NULL. Returns NULL, with errno set,
+// if the device can't be opened or its table can't be read.
+GDISK_API struct gdisk *gdisk_open(const char *device, const struct gdisk_options *options);
+GDISK_API void gdisk_close(struct gdisk *g); // Unwritten changes are dropped.
+GDISK_API int gdisk_read(struct gdisk *g);   // Reads the table from the device again, dropping unwritten changes. Kept if it fails.
+GDISK_API bool gdisk_dirty(struct gdisk *g); // Whether there are changes that haven't been written.
+
+struct gdisk_partition {
+    char type[37];         // GUID
+    const char *type_name; // NULL if it's not a type we know
+    char guid[37];
+    uint64_t first_lba, last_lba;
+    uint64_t attributes;
+    char label[36*3+1];    // UTF-8
+};
+
+GDISK_API int gdisk_sector_size(struct gdisk *g);
+GDISK_API int gdisk_partition_entries(struct gdisk *g); // The size of the table, used or not.
+GDISK_API int gdisk_partition(struct gdisk *g, int index, struct gdisk_partition *p); // ENOENT if entry |index| is empty.
+
+GDISK_API int gdisk_clear(struct gdisk *g); // A fresh, empty GPT.
+// |type| is a name or GUID. A |size| of 0 takes the biggest free space. |label| and |index| (where the new entry went)
+// can be NULL. Labels going in are ASCII, as in gdisk.
+GDISK_API int gdisk_create(struct gdisk *g, const char *type, uint64_t size, const char *label, int *index);
+GDISK_API int gdisk_delete(struct gdisk *g, int index);
+GDISK_API int gdisk_edit(struct gdisk *g, int index, const char *type, const char *label, const char *guid); // NULLs stay the same.
+GDISK_API int gdisk_write(struct gdisk *g, bool force); // |force| writes even if the backup (in ~/.gdisk/backups) fails.
+
+// Adds the partition types listed in |path| (like gdisk's --types). Call it before there are other threads around.
+GDISK_API int gdisk_load_types(const char *path);
+
+// Runs |command| in gdisk's command language, for everything else.
+GDISK_API int gdisk_run(struct gdisk *g, const char *command);
+
+#endif /* __LIBGDISK_H__ */
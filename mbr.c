@@ -41,19 +41,19 @@ struct mbr mbr_from_sector(void *sector)
     return mbr;
 }
 
-void *sector_from_mbr(struct device *dev, struct mbr mbr)
+void *sector_from_mbr(struct device *dev, struct mbr *mbr)
 {
     unsigned char *mbr_buf = alloc_sectors(dev, 1);
-    memcpy(mbr_buf, mbr.code, sizeof(mbr.code));
-    mbr_buf[440] = mbr.disk_signature >>  0 & 0xff;
-    mbr_buf[441] = mbr.disk_signature >>  8 & 0xff;
-    mbr_buf[442] = mbr.disk_signature >> 16 & 0xff;
-    mbr_buf[443] = mbr.disk_signature >> 24 & 0xff;
-    mbr_buf[444] = mbr.unused >>  0 & 0xff;
-    mbr_buf[445] = mbr.unused >>  8 & 0xff;
-    for (int i=0; i<lengthof(mbr.partition); i++) {
+    memcpy(mbr_buf, mbr->code, sizeof(mbr->code));
+    mbr_buf[440] = mbr->disk_signature >>  0 & 0xff;
+    mbr_buf[441] = mbr->disk_signature >>  8 & 0xff;
+    mbr_buf[442] = mbr->disk_signature >> 16 & 0xff;
+    mbr_buf[443] = mbr->disk_signature >> 24 & 0xff;
+    mbr_buf[444] = mbr->unused >>  0 & 0xff;
+    mbr_buf[445] = mbr->unused >>  8 & 0xff;
+    for (int i=0; i<lengthof(mbr->partition); i++) {
         int po = 446 + i*16;
-        struct mbr_partition *p = &mbr.partition[i];
+        struct mbr_partition *p = &mbr->partition[i];
         mbr_buf[po +  0] = p->status;
         mbr_buf[po +  1] = p->first_sector.head;
         mbr_buf[po +  2] = p->first_sector.sector        & 0x3f |
@@ -73,20 +73,22 @@ void *sector_from_mbr(struct device *dev, struct mbr mbr)
         mbr_buf[po + 14] = p->sectors >> 16 & 0xff;
         mbr_buf[po + 15] = p->sectors >> 24 & 0xff;
     }
-    mbr_buf[510] = mbr.mbr_signature >> 0 & 0xff;
-    mbr_buf[511] = mbr.mbr_signature >> 8 & 0xff;
+    mbr_buf[510] = mbr->mbr_signature >> 0 & 0xff;
+    mbr_buf[511] = mbr->mbr_signature >> 8 & 0xff;
     return mbr_buf;
 }
 
-struct mbr read_mbr(struct device *dev)
+bool read_mbr(struct device *dev, struct mbr *mbr)
 {
     void *sector = get_sectors(dev, 0, 1);
-    struct mbr mbr = mbr_from_sector(sector);
+    if (!sector)
+        return false;
+    *mbr = mbr_from_sector(sector);
     free(sector);
-    return mbr;
+    return true;
 }
 
-bool write_mbr(struct device *dev, struct mbr mbr)
+bool write_mbr(struct device *dev, struct mbr *mbr)
 {
     void *sector = sector_from_mbr(dev, mbr);
     bool status = device_write(dev, sector, 0, 1);
@@ -95,22 +97,22 @@ bool write_mbr(struct device *dev, struct mbr mbr)
 }
 
 #include <stdio.h>
-void dump_mbr(struct mbr mbr)
+void dump_mbr(struct mbr *mbr)
 {
     //char code[440];
-    printf("disk_signature             = %08x\n", mbr.disk_signature);
-    printf("unused                     = %02x\n", mbr.unused);
+    printf("disk_signature             = %08x\n", mbr->disk_signature);
+    printf("unused                     = %02x\n", mbr->unused);
     for (int i=0; i<4; i++) {
-        printf("[%d] status                = %02x\n", i, mbr.partition[i].status);
-        printf("[%d] first_sector.cylinder = %d\n",   i, mbr.partition[i].first_sector.cylinder);
-        printf("[%d] first_sector.head     = %d\n",   i, mbr.partition[i].first_sector.head);
-        printf("[%d] first_sector.sector   = %d\n",   i, mbr.partition[i].first_sector.sector);
-        printf("[%d] partition_type        = %02x\n", i, mbr.partition[i].partition_type);
-        printf("[%d] last_sector.cylinder  = %d\n",   i, mbr.partition[i].last_sector.cylinder);
-        printf("[%d] last_sector.head      = %d\n",   i, mbr.partition[i].last_sector.head);
-        printf("[%d] last_sector.sector    = %d\n",   i, mbr.partition[i].last_sector.sector);
-        printf("[%d] first_sector_lba      = %u\n",   i, mbr.partition[i].first_sector_lba);
-        printf("[%d] sectors               = %u\n",   i, mbr.partition[i].sectors);
+        printf("[%d] status                = %02x\n", i, mbr->partition[i].status);
+        printf("[%d] first_sector.cylinder = %d\n",   i, mbr->partition[i].first_sector.cylinder);
+        printf("[%d] first_sector.head     = %d\n",   i, mbr->partition[i].first_sector.head);
+        printf("[%d] first_sector.sector   = %d\n",   i, mbr->partition[i].first_sector.sector);
+        printf("[%d] partition_type        = %02x\n", i, mbr->partition[i].partition_type);
+        printf("[%d] last_sector.cylinder  = %d\n",   i, mbr->partition[i].last_sector.cylinder);
+        printf("[%d] last_sector.head      = %d\n",   i, mbr->partition[i].last_sector.head);
+        printf("[%d] last_sector.sector    = %d\n",   i, mbr->partition[i].last_sector.sector);
+        printf("[%d] first_sector_lba      = %u\n",   i, mbr->partition[i].first_sector_lba);
+        printf("[%d] sectors               = %u\n",   i, mbr->partition[i].sectors);
     }
-    printf("signature                  = %02x\n",mbr.mbr_signature);
+    printf("signature                  = %02x\n",mbr->mbr_signature);
 }
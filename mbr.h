@@ -29,11 +29,11 @@ struct mbr {
 #define MBR_STATUS_BOOTABLE   0x80
 
 struct mbr init_mbr(struct device *dev);
-struct mbr read_mbr(struct device *dev);
-bool write_mbr(struct device *dev, struct mbr mbr);
-void dump_mbr(struct mbr mbr);
+bool read_mbr(struct device *dev, struct mbr *mbr);
+bool write_mbr(struct device *dev, struct mbr *mbr);
+void dump_mbr(struct mbr *mbr);
 struct mbr mbr_from_sector(void *sector); // frees sector
-void *sector_from_mbr(struct device *dev, struct mbr mbr); // returns malloced mem
+void *sector_from_mbr(struct device *dev, struct mbr *mbr); // returns malloced mem
 
 
 #endif /* __MBR_H__ */
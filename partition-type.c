@@ -1,7 +1,23 @@
 //  Copyright (c) 2009 David Caldwell,  All Rights Reserved.
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lengthof.h"
 #include "guid.h"
+#include "xmem.h"
 #include "partition-type.h"
+#include "crc32.h"
 
 // This list came from <http://en.wikipedia.org/wiki/GUID_Partition_Table>. Hardly definitive, but convenient.
 // If you know where these are originally defined, please document them.
@@ -171,8 +187,554 @@ char *mbr_partition_type[256] = {
 
 int find_mbr_equivalent(GUID g)
 {
-    for (int i=0; gpt_partition_type[i].name; i++)
-        if (guid_eq(g, gpt_partition_type[i].guid))
-            return gpt_partition_type[i].mbr_equivalent[0];
-    return 0;
+    struct gpt_partition_type *type = partition_type_from_guid(g);
+    return type ? type->mbr_equivalent[0] : 0;
+}
+
+// The index: open addressed hash tables keyed on GUID and on folded name, the MBR byte mapping, and every name
+// (with '_' for ' ') sorted for prefix completion. It's built once, the first time anything needs it.
+static pthread_once_t idx_once = PTHREAD_ONCE_INIT;
+static struct {
+    int types;
+    unsigned mask; // hash table size - 1
+    struct gpt_partition_type **by_guid;
+    struct gpt_partition_type **by_name;
+    char **names; // "names" in by_guid order, for partition_type_names()
+    GUID from_mbr[256];
+    char **completion;
+} idx;
+
+static int fold(int c) { return c == ' ' ? '_' : tolower(c); }
+
+static unsigned name_hash(const char *name)
+{
+    unsigned hash = 2166136261u; // FNV-1a
+    for (; *name; name++)
+        hash = (hash ^ fold((unsigned char)*name)) * 16777619u;
+    return hash;
+}
+
+static bool name_eq(const char *a, const char *b)
+{
+    for (; *a && *b; a++, b++)
+        if (fold((unsigned char)*a) != fold((unsigned char)*b))
+            return false;
+    return *a == *b;
+}
+
+static unsigned guid_hash(GUID g)
+{
+    // GUIDs are mostly random already. Mix both halves so the ones that only differ at the end still spread out.
+    uint64_t a, b;
+    memcpy(&a, &g.byte[0], sizeof(a));
+    memcpy(&b, &g.byte[8], sizeof(b));
+    uint64_t x = (a ^ b * 0x9e3779b97f4a7c15ull) * 0xbf58476d1ce4e5b9ull;
+    return x >> 32;
+}
+
+static int compare_completion(const void *a, const void *b)
+{
+    return strcasecmp(*(char **)a, *(char **)b);
+}
+
+static void build_index()
+{
+    int types = 0;
+    for (struct gpt_partition_type *t = gpt_partition_type; t->name; t++)
+        types++;
+    unsigned size = 1;
+    while (size < types * 2)
+        size *= 2;
+    idx.types = types;
+    idx.mask = size - 1;
+    idx.by_guid = xcalloc(size, sizeof(*idx.by_guid));
+    idx.by_name = xcalloc(size, sizeof(*idx.by_name));
+    idx.names   = xcalloc(size, sizeof(*idx.names));
+    idx.completion = xcalloc(types, sizeof(*idx.completion));
+
+    for (int i=0; i<types; i++) {
+        struct gpt_partition_type *t = &gpt_partition_type[i];
+        t->next_alias = NULL;
+
+        unsigned h = guid_hash(t->guid) & idx.mask;
+        while (idx.by_guid[h] && !guid_eq(idx.by_guid[h]->guid, t->guid))
+            h = (h + 1) & idx.mask;
+        if (!idx.by_guid[h]) {
+            idx.by_guid[h] = t;
+            idx.names[h] = xstrdup(t->name);
+        } else {
+            struct gpt_partition_type *last = idx.by_guid[h];
+            while (last->next_alias)
+                last = last->next_alias;
+            last->next_alias = t;
+            xsprintf(&idx.names[h], "%s or %s", idx.names[h], t->name); // Leaks the old one. Once, at startup.
+        }
+
+        h = name_hash(t->name) & idx.mask;
+        while (idx.by_name[h] && !name_eq(idx.by_name[h]->name, t->name))
+            h = (h + 1) & idx.mask;
+        if (!idx.by_name[h]) // First one wins, same as a linear search would.
+            idx.by_name[h] = t;
+
+        for (int m=0; t->mbr_equivalent[m]; m++)
+            if (guid_eq(idx.from_mbr[t->mbr_equivalent[m]], gpt_partition_type_empty))
+                idx.from_mbr[t->mbr_equivalent[m]] = t->guid;
+
+        idx.completion[i] = xstrdup(t->name);
+        for (char *c = idx.completion[i]; *c; c++)
+            if (*c == ' ') *c = '_';
+    }
+    qsort(idx.completion, types, sizeof(*idx.completion), compare_completion);
+}
+
+static inline void index_types()
+{
+    pthread_once(&idx_once, build_index);
+}
+
+static int guid_slot(GUID g)
+{
+    index_types();
+    for (unsigned h = guid_hash(g) & idx.mask; idx.by_guid[h]; h = (h + 1) & idx.mask)
+        if (guid_eq(idx.by_guid[h]->guid, g))
+            return h;
+    return -1;
+}
+
+// Extra types can come from a text file, one per line:
+//
+//     <guid> <mbr types> <name>
+//
+// <mbr types> is a comma separated list of hex MBR partition types, or "-" for none. The name is the rest of the line.
+// Blank lines and lines starting with '#' are ignored.
+//
+// Parsing that and hashing it all on every start would add up with a few thousand vendor types, so the file gets
+// compiled to <file>.idx: the same tables as the built-in index, but flat, so they can be mmap()ed and used in place.
+// It's rebuilt whenever the text file's size or contents change. Checking the contents means reading the file, but
+// that's cheap next to parsing it, and a timestamp can't see two edits that land in the same clock tick. Types from
+// the file win over built-in ones.
+#define TYPE_DB_MAGIC "gdisktdb"
+#define TYPE_DB_VERSION 2
+#define TYPE_DB_BYTE_ORDER 0x01020304 // Everything's in host order, so an index made on a different machine is stale.
+
+struct type_db_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t source_size;  // Of the text file it was compiled from
+    uint32_t source_crc;   // gpt_crc32() of its contents
+    uint32_t types;
+    uint32_t hash_size;    // A power of 2, bigger than types
+    uint32_t strings_size;
+    // Followed by:
+    //   struct type_db_entry entry[types];
+    //   uint32_t by_guid[hash_size], by_name[hash_size]; // entry index + 1, or 0 for an empty slot
+    //   uint32_t completion[types];                      // entry indexes, sorted by completion name
+    //   uint32_t from_mbr[256];                          // entry index + 1, or 0
+    //   char strings[strings_size];
+};
+
+struct type_db_entry {
+    GUID guid;
+    uint32_t name, names, completion; // Offsets into strings. names is the " or " list, in a GUID's first entry.
+    uint32_t next_alias;              // Entry index + 1 of the next type with the same GUID, or 0
+    uint8_t mbr_equivalent[12];       // 0 terminated
+};
+
+static struct {
+    const struct type_db_header *header;
+    const struct type_db_entry *entry;
+    const uint32_t *by_guid, *by_name, *completion, *from_mbr;
+    const char *strings;
+    struct gpt_partition_type **type; // What the lookups hand out, made from entry[] the first time they're asked for
+} db;
+
+static size_t type_db_size(uint32_t types, uint32_t hash_size, uint32_t strings_size)
+{
+    return sizeof(struct type_db_header) + sizeof(struct type_db_entry) * types +
+           sizeof(uint32_t) * (2 * hash_size + types + 256) + strings_size;
+}
+
+// The text file an index was compiled from, to tell whether the index still goes with it.
+struct type_db_source {
+    uint64_t size;
+    uint32_t crc;
+};
+
+// Starts using the index in |data| if it's sane and goes with |source|.
+static bool type_db_use(const void *data, size_t size, struct type_db_source *source)
+{
+    const struct type_db_header *h = data;
+    if (size < sizeof(*h) || memcmp(h->magic, TYPE_DB_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != TYPE_DB_VERSION || h->byte_order != TYPE_DB_BYTE_ORDER ||
+        h->source_size != source->size || h->source_crc != source->crc ||
+        h->hash_size <= h->types || h->hash_size & (h->hash_size - 1) || !h->strings_size ||
+        size != type_db_size(h->types, h->hash_size, h->strings_size) || ((const char *)data)[size-1] != '\0')
+        return false;
+    db.header     = h;
+    db.entry      = (const void *)(h + 1);
+    db.by_guid    = (const void *)(db.entry + h->types);
+    db.by_name    = db.by_guid + h->hash_size;
+    db.completion = db.by_name + h->hash_size;
+    db.from_mbr   = db.completion + h->types;
+    db.strings    = (const void *)(db.from_mbr + 256);
+    db.type = xcalloc(h->types + 1, sizeof(*db.type));
+    return true;
+}
+
+static const char *db_string(uint32_t offset)
+{
+    return offset < db.header->strings_size ? db.strings + offset : "";
+}
+
+// 0 or entry index + 1 (as stored in the tables) to a valid entry index, or -1
+static int db_index(uint32_t slot)
+{
+    return slot && slot - 1 < db.header->types ? (int)(slot - 1) : -1;
+}
+
+// Two threads can both get here for the same entry. They build identical copies and the first one to be published
+// wins. The alias chain is finished before publishing, so nobody sees a half built one.
+static struct gpt_partition_type *db_type(int e)
+{
+    struct gpt_partition_type *t = __atomic_load_n(&db.type[e], __ATOMIC_ACQUIRE);
+    if (t)
+        return t;
+    const struct type_db_entry *entry = &db.entry[e];
+    t = xcalloc(1, sizeof(*t));
+    t->name = (char *)db_string(entry->name);
+    t->guid = entry->guid;
+    for (int m=0; m < lengthof(t->mbr_equivalent)-1 && m < lengthof(entry->mbr_equivalent) && entry->mbr_equivalent[m]; m++)
+        t->mbr_equivalent[m] = entry->mbr_equivalent[m];
+    int next = db_index(entry->next_alias);
+    t->next_alias = next > e ? db_type(next) : NULL; // Chains only go forward, so a bad index can't make us loop.
+    struct gpt_partition_type *expected = NULL;
+    if (!__atomic_compare_exchange_n(&db.type[e], &expected, t, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(t);
+        t = expected;
+    }
+    return t;
+}
+
+static int db_guid(GUID g)
+{
+    if (!db.header) return -1;
+    uint32_t mask = db.header->hash_size - 1;
+    for (uint32_t h = guid_hash(g) & mask, probes = 0; probes <= mask && db.by_guid[h]; h = (h + 1) & mask, probes++) {
+        int e = db_index(db.by_guid[h]);
+        if (e >= 0 && guid_eq(db.entry[e].guid, g))
+            return e;
+    }
+    return -1;
+}
+
+static int db_name(const char *name)
+{
+    if (!db.header) return -1;
+    uint32_t mask = db.header->hash_size - 1;
+    for (uint32_t h = name_hash(name) & mask, probes = 0; probes <= mask && db.by_name[h]; h = (h + 1) & mask, probes++) {
+        int e = db_index(db.by_name[h]);
+        if (e >= 0 && name_eq(db_string(db.entry[e].name), name))
+            return e;
+    }
+    return -1;
+}
+
+static uint32_t add_string(char **strings, uint32_t *size, const char *s)
+{
+    uint32_t offset = *size;
+    size_t length = strlen(s) + 1;
+    *strings = xrealloc(*strings, *size + length);
+    memcpy(*strings + offset, s, length);
+    *size += length;
+    return offset;
+}
+
+static char *next_word(char **s)
+{
+    while (isspace((unsigned char)**s)) (*s)++;
+    char *word = *s;
+    while (**s && !isspace((unsigned char)**s)) (*s)++;
+    if (**s) *(*s)++ = '\0';
+    return word;
+}
+
+static const struct type_db_entry *sort_entry;
+static const char *sort_strings;
+static int compare_db_completion(const void *a, const void *b)
+{
+    return strcasecmp(sort_strings + sort_entry[*(uint32_t *)a].completion, sort_strings + sort_entry[*(uint32_t *)b].completion);
+}
+
+// Parses the text file into a freshly malloc()ed index. NULL (after complaining) if the file has problems.
+static void *type_db_compile(char *path, FILE *f, struct type_db_source *source, size_t *size)
+{
+    struct type_db_entry *entry = NULL;
+    uint32_t types = 0;
+    char *strings = NULL;
+    uint32_t strings_size = 0;
+    add_string(&strings, &strings_size, "");
+
+    char *line = NULL;
+    size_t line_size = 0;
+    for (int n=1; getline(&line, &line_size, f) != -1; n++) {
+        char *rest = line;
+        char *guid = next_word(&rest);
+        if (!*guid || *guid == '#')
+            continue;
+        char *mbr = next_word(&rest);
+        char *name = rest + strspn(rest, " \t");
+        for (char *e = name + strlen(name); e > name && isspace((unsigned char)e[-1]); )
+            *--e = '\0';
+
+        struct type_db_entry t = { .guid = guid_from_string(guid) };
+        if (!*mbr || !*name) {
+            warnx("%s:%d: Expected \"<guid> <mbr types> <name>\"", path, n);
+            goto fail;
+        }
+        if (guid_eq(t.guid, bad_guid)) {
+            warnx("%s:%d: Bad GUID \"%s\"", path, n, guid);
+            goto fail;
+        }
+        for (int m=0; strcmp(mbr, "-") != 0 && *mbr; m++) {
+            char *end;
+            unsigned long type = strtoul(mbr, &end, 16);
+            if (end == mbr || type == 0 || type > 0xff || *end && *end != ',' || m == lengthof(t.mbr_equivalent)-1) {
+                warnx("%s:%d: Bad MBR type list", path, n);
+                goto fail;
+            }
+            t.mbr_equivalent[m] = type;
+            mbr = *end ? end + 1 : end;
+        }
+        t.name = add_string(&strings, &strings_size, name);
+        for (char *c = name; *c; c++)
+            if (*c == ' ') *c = '_';
+        t.completion = add_string(&strings, &strings_size, name);
+        entry = xrealloc(entry, sizeof(*entry) * (types + 1));
+        entry[types++] = t;
+    }
+
+    uint32_t hash_size = 1;
+    while (hash_size <= types * 2)
+        hash_size *= 2;
+    uint32_t *by_guid = xcalloc(hash_size, sizeof(*by_guid)),
+             *by_name = xcalloc(hash_size, sizeof(*by_name)),
+             *completion = xcalloc(types + 1, sizeof(*completion)),
+             from_mbr[256] = {};
+    char **names = xcalloc(types + 1, sizeof(*names));
+    for (uint32_t i=0; i<types; i++) {
+        const char *name = strings + entry[i].name;
+        uint32_t h = guid_hash(entry[i].guid) & (hash_size - 1);
+        while (by_guid[h] && !guid_eq(entry[by_guid[h]-1].guid, entry[i].guid))
+            h = (h + 1) & (hash_size - 1);
+        if (!by_guid[h]) {
+            by_guid[h] = i + 1;
+            names[i] = xstrdup((char *)name);
+        } else {
+            uint32_t first = by_guid[h] - 1, last = first;
+            while (entry[last].next_alias)
+                last = entry[last].next_alias - 1;
+            entry[last].next_alias = i + 1;
+            char *joined;
+            xsprintf(&joined, "%s or %s", names[first], name);
+            free(names[first]);
+            names[first] = joined;
+        }
+
+        h = name_hash(name) & (hash_size - 1);
+        while (by_name[h] && !name_eq(strings + entry[by_name[h]-1].name, name))
+            h = (h + 1) & (hash_size - 1);
+        if (!by_name[h])
+            by_name[h] = i + 1;
+
+        for (int m=0; entry[i].mbr_equivalent[m]; m++)
+            if (!from_mbr[entry[i].mbr_equivalent[m]])
+                from_mbr[entry[i].mbr_equivalent[m]] = i + 1;
+        completion[i] = i;
+    }
+    for (uint32_t i=0; i<types; i++) {
+        entry[i].names = names[i] ? add_string(&strings, &strings_size, names[i]) : entry[i].name;
+        free(names[i]);
+    }
+    sort_entry = entry;
+    sort_strings = strings;
+    qsort(completion, types, sizeof(*completion), compare_db_completion);
+
+    *size = type_db_size(types, hash_size, strings_size);
+    struct type_db_header *h = xcalloc(1, *size);
+    *h = (struct type_db_header) {
+        .magic = TYPE_DB_MAGIC, // No room for the '\0', which is fine
+        .version = TYPE_DB_VERSION,
+        .byte_order = TYPE_DB_BYTE_ORDER,
+        .source_size = source->size,
+        .source_crc = source->crc,
+        .types = types,
+        .hash_size = hash_size,
+        .strings_size = strings_size,
+    };
+    char *p = (char *)(h + 1);
+#define append(data, bytes) ({ memcpy(p, data, bytes); p += bytes; })
+    append(entry,      sizeof(*entry) * types);
+    append(by_guid,    sizeof(*by_guid) * hash_size);
+    append(by_name,    sizeof(*by_name) * hash_size);
+    append(completion, sizeof(*completion) * types);
+    append(from_mbr,   sizeof(from_mbr));
+    append(strings,    strings_size);
+#undef append
+
+    free(by_guid);
+    free(by_name);
+    free(completion);
+    free(names);
+    free(entry);
+    free(strings);
+    free(line);
+    return h;
+
+  fail:
+    free(entry);
+    free(strings);
+    free(line);
+    return NULL;
+}
+
+// Best effort. If the directory isn't writable we just compile it again next time.
+static void type_db_save(char *index_path, void *data, size_t size)
+{
+    char *temp;
+    xsprintf(&temp, "%s.%d", index_path, getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        bool ok = write(fd, data, size) == size;
+        if (close(fd) == 0 && ok && rename(temp, index_path) == 0)
+            goto done;
+        unlink(temp);
+    }
+  done:
+    free(temp);
+}
+
+bool partition_types_load(char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        warn("Couldn't open partition type file %s", path);
+        return false;
+    }
+    struct type_db_source source = {};
+    char buffer[65536];
+    for (size_t got; (got = fread(buffer, 1, sizeof(buffer), f)); source.size += got)
+        source.crc = gpt_crc32(source.crc, buffer, got);
+    if (ferror(f)) {
+        warn("Couldn't read %s", path);
+        fclose(f);
+        return false;
+    }
+    rewind(f);
+
+    char *index_path;
+    xsprintf(&index_path, "%s.idx", path);
+    bool loaded = false;
+    int fd = open(index_path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED && !(loaded = type_db_use(map, st.st_size, &source)))
+            munmap(map, st.st_size);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (!loaded) {
+        size_t size;
+        void *data = type_db_compile(path, f, &source, &size);
+        if (data) {
+            type_db_save(index_path, data, size);
+            loaded = type_db_use(data, size, &source);
+        }
+    }
+    fclose(f);
+    free(index_path);
+    return loaded;
+}
+
+struct gpt_partition_type *partition_type_from_guid(GUID g)
+{
+    int e = db_guid(g);
+    if (e >= 0)
+        return db_type(e);
+    int h = guid_slot(g);
+    return h < 0 ? NULL : idx.by_guid[h];
+}
+
+char *partition_type_names(GUID g)
+{
+    int e = db_guid(g);
+    if (e >= 0)
+        return (char *)db_string(db.entry[e].names);
+    int h = guid_slot(g);
+    return h < 0 ? NULL : idx.names[h];
+}
+
+struct gpt_partition_type *partition_type_from_name(char *name)
+{
+    int e = db_name(name);
+    if (e >= 0)
+        return db_type(e);
+    index_types();
+    for (unsigned h = name_hash(name) & idx.mask; idx.by_name[h]; h = (h + 1) & idx.mask)
+        if (name_eq(idx.by_name[h]->name, name))
+            return idx.by_name[h];
+    return NULL;
+}
+
+GUID partition_type_from_mbr(int mbr_type)
+{
+    int e = db.header ? db_index(db.from_mbr[mbr_type & 0xff]) : -1;
+    if (e >= 0)
+        return db.entry[e].guid;
+    index_types();
+    return idx.from_mbr[mbr_type & 0xff];
+}
+
+static const char *builtin_completion(int i) { return idx.completion[i]; }
+static const char *db_completion(int i)
+{
+    uint32_t e = db.completion[i];
+    return e < db.header->types ? db_string(db.entry[e].completion) : "";
+}
+
+// The first of |count| sorted names that's >= prefix
+static int lower_bound(int count, const char *(*name)(int), const char *prefix)
+{
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcasecmp(name(mid), prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+char *partition_type_completion_name(const char *prefix, int n)
+{
+    index_types();
+    size_t length = strlen(prefix);
+    int db_types = db.header ? db.header->types : 0;
+    int b = lower_bound(idx.types, builtin_completion, prefix),
+        d = lower_bound(db_types,  db_completion,      prefix);
+    // Walk both sorted lists together. A name in both only counts once.
+    for (;;) {
+        const char *builtin = b < idx.types && strncasecmp(builtin_completion(b), prefix, length) == 0 ? builtin_completion(b) : NULL;
+        const char *loaded  = d < db_types  && strncasecmp(db_completion(d),      prefix, length) == 0 ? db_completion(d)      : NULL;
+        if (!builtin && !loaded)
+            return NULL;
+        int order = !builtin ? 1 : !loaded ? -1 : strcasecmp(builtin, loaded);
+        if (order <= 0) b++;
+        if (order >= 0) d++;
+        if (n-- == 0)
+            return (char *)(order < 0 ? builtin : loaded);
+    }
 }
@@ -2,12 +2,14 @@
 #ifndef __PARTITION_TYPE_H__
 #define __PARTITION_TYPE_H__
 
+#include <stdbool.h>
 #include "guid.h"
 
 struct gpt_partition_type {
     char *name;
     GUID guid;
     int mbr_equivalent[10];
+    struct gpt_partition_type *next_alias; // The next type with the same GUID. Filled in by the index.
 };
 
 extern struct gpt_partition_type gpt_partition_type[];
@@ -17,5 +19,16 @@ extern char *mbr_partition_type[256];
 
 int find_mbr_equivalent(GUID g);
 
+// These all go through an index that gets built the first time one of them is called.
+struct gpt_partition_type *partition_type_from_guid(GUID g);  // The first type with this GUID (others via next_alias), or NULL.
+struct gpt_partition_type *partition_type_from_name(char *name); // Case insensitive, and '_' matches ' '. NULL if unknown.
+GUID partition_type_from_mbr(int mbr_type);                    // gpt_partition_type_empty if there's no equivalent.
+char *partition_type_names(GUID g);                            // "Name or Other name", or NULL if unknown.
+char *partition_type_completion_name(const char *prefix, int n); // The nth name (spaces as '_') starting with prefix, or NULL.
+
+// Adds the types listed in a text file (see partition-type.c for the format). They take precedence over the built-in ones.
+// The lookups above are fine to use from several threads, but this isn't: call it before starting any.
+bool partition_types_load(char *path);
+
 #endif /* __PARTITION_TYPE_H__ */
 
@@ -0,0 +1,1889 @@
+// Copyright © 2008-2024 David Caldwell <david@porkrind.org>
+// Copyright © 2009      Jim Radford <radford@blackbean.org>
+
+// The partition table itself: reading it, the commands that change it, and writing it back out. Everything works on
+// the struct partition_table it's handed, so any number of tables can be open at once.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <assert.h>
+#include <wchar.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/param.h> // PATH_MAX on both linux and OS X
+#include <sys/stat.h>  // mkdir
+#include <unistd.h>
+#include <err.h>
+#include "lengthof.h"
+#include "round.h"
+#include "guid.h"
+#include "partition-type.h"
+#include "device.h"
+#include "gpt.h"
+#include "mbr.h"
+#include "human.h"
+#include "xmem.h"
+#include "dalloc.h"
+#include "gdisk.h"
+
+static char *fit_name[] = { [Fit_First] = "first", [Fit_Best] = "best", [Fit_Worst] = "worst", [Fit_End] = "end" };
+static void extents_changed(struct partition_table *t);
+static void dump_dev(struct device *dev);
+static void dump_header(struct gpt_header *header);
+static void dump_partition(struct gpt_partition *p);
+static size_t sncatprintf(char *buffer, size_t space, char *format, ...) __attribute__ ((format (printf, 3, 4)));
+
+// The partition array CRC is kept as a tree of per-entry CRCs so that changing one entry only costs re-hashing that
+// entry and then stitching log2(entries) pairs of CRCs back together on the way up to the root. node[1] is the root,
+// the children of node[n] are node[2n] and node[2n+1], and the leaves start at node[leaves]. Leaves past the last
+// entry are zero length and combine away to nothing.
+struct entry_crc {
+    int entries;
+    int entry_size;
+    int leaves;
+    bool stale; // Some nodes need rehashing
+    struct {
+        uint32_t crc;
+        uint32_t op; // gpt_crc32_combine_gen() of the right child's length
+        bool stale;
+    } node[];
+};
+
+static void entry_crc_combine(struct entry_crc *c, int n)
+{
+    c->node[n].crc = gpt_crc32_combine_op(c->node[2*n].crc, c->node[2*n+1].crc, c->node[n].op);
+}
+
+static struct entry_crc *entry_crc_build(struct partition_table *t)
+{
+    int entries = t->header->partition_entries, leaves = 1;
+    while (leaves < entries)
+        leaves *= 2;
+    struct entry_crc *c = xcalloc(1, sizeof(*c) + sizeof(c->node[0]) * 2 * leaves);
+    c->entries = entries;
+    c->entry_size = t->header->partition_entry_size;
+    c->leaves = leaves;
+    for (int i=0; i<leaves; i++)
+        c->node[leaves+i].crc = i < entries ? gpt_partition_entry_crc32(t->header, &t->partition[i]) : 0;
+    for (int n=leaves-1; n>0; n--) {
+        int width = 1; // in leaves
+        for (int m=2*n+1; m<leaves; m*=2)
+            width *= 2;
+        int first = (2*n+1) * width - leaves;
+        int count = MAX(0, MIN(width, entries - first));
+        c->node[n].op = gpt_crc32_combine_gen((uint64_t)count * c->entry_size);
+        entry_crc_combine(c, n);
+    }
+    return c;
+}
+
+// Call after changing a single partition entry in place. The CRCs get brought up to date by update_table_crc().
+static void partition_changed(struct partition_table *t, int index)
+{
+    struct entry_crc *c = t->entry_crc;
+    if (!c) return; // Nothing cached yet--update_table_crc() will hash everything.
+    c->node[c->leaves + index].stale = true;
+    c->stale = true;
+    t->crc_stale = true;
+}
+
+// Call after shuffling or rewriting the partition entries wholesale.
+static void partitions_changed(struct partition_table *t)
+{
+    free(t->entry_crc);
+    t->entry_crc = NULL;
+    t->crc_stale = true;
+}
+
+// Brings the header and partition array CRCs up to date, if anything changed since last time. Anything about to look
+// at the CRCs (writing, exporting, verifying, dumping the header) needs to call this first.
+static void update_table_crc(struct partition_table *t)
+{
+    if (!t->crc_stale) return;
+    if (t->entry_crc && (t->entry_crc->entries    != t->header->partition_entries ||
+                         t->entry_crc->entry_size != t->header->partition_entry_size))
+        partitions_changed(t);
+    struct entry_crc *c = t->entry_crc;
+    if (!c)
+        c = t->entry_crc = entry_crc_build(t);
+    else if (c->stale) {
+        // Rehash the changed entries, then recombine just the nodes above them.
+        for (int i=0; i<c->entries; i++)
+            if (c->node[c->leaves + i].stale) {
+                c->node[c->leaves + i].crc = gpt_partition_entry_crc32(t->header, &t->partition[i]);
+                c->node[c->leaves + i].stale = false;
+                c->node[(c->leaves + i) / 2].stale = true;
+            }
+        for (int n=c->leaves-1; n>0; n--)
+            if (c->node[n].stale) {
+                entry_crc_combine(c, n);
+                c->node[n].stale = false;
+                c->node[n/2].stale = true;
+            }
+        c->stale = false;
+    }
+
+    // Both headers describe the same partition entries so there's no need to CRC them twice.
+    t->header->partition_crc32 = t->alt_header->partition_crc32 = c->node[1].crc;
+    t->header->header_crc32     = gpt_header_crc32(t->header);
+    t->alt_header->header_crc32 = gpt_header_crc32(t->alt_header);
+    t->crc_stale = false;
+}
+
+static bool gpt_crc_valid(struct gpt_header *h, struct gpt_partition *p)
+{
+    return h->partition_crc32 == gpt_partition_crc32(h, p) && h->header_crc32 == gpt_header_crc32(h);
+}
+
+static void utf16_from_ascii(uint16_t *utf16le, char *ascii, int n)
+{
+    if (!n) return;
+    while (--n && (*utf16le++ = *ascii++)) {}
+    *utf16le = '\0';
+}
+
+static bool partition_entry_is_representable_in_mbr(struct gpt_partition *entry)
+{
+    // MBR only has 32 bits for the LBA. So if the partition is further up the disk than that then it can't be represented in the MBR.
+    return !guid_eq(gpt_partition_type_empty, entry->partition_type) &&
+           entry->first_lba < 0x100000000LL &&
+           entry->last_lba - entry->first_lba < 0x100000000LL;
+}
+
+// Call after changing the MBR (or the GPT layout) in a way that might change which partitions line up.
+static void mbr_aliases_changed(struct partition_table *t)
+{
+    t->aliases_stale = true;
+}
+
+static void create_mbr_alias_table(struct partition_table *t)
+{
+    t->aliases_stale = false;
+    int synced = -1;
+    for (int i=0; i<lengthof(t->alias); i++)
+        t->alias[i] = -1;
+    for (int mp=0; mp<lengthof(t->mbr.partition); mp++) {
+        if (!t->mbr.partition[mp].partition_type)
+            continue;
+        for (int gp=0; gp<t->header->partition_entries; gp++)
+            if (partition_entry_is_representable_in_mbr(&t->partition[gp]) &&
+                (t->mbr.partition[mp].first_sector_lba == t->partition[gp].first_lba ||
+                 // first partition could be type EE which covers the GPT partition table and the optional EFI filesystem.
+                 // The EFI filesystem in the GPT doesn't cover the EFI partition table, so the starts might not line up.
+                 t->mbr.partition[mp].first_sector_lba == 1 && t->mbr.partition[mp].partition_type == 0xee) &&
+                t->mbr.partition[mp].first_sector_lba + t->mbr.partition[mp].sectors == t->partition[gp].last_lba + 1) {
+                t->alias[mp] = gp;
+                if (synced < 0) synced = 1;
+                break;
+            }
+        if (t->alias[mp] == -1)
+            synced = 0;
+    }
+    t->options.mbr_sync = synced == 1;
+}
+
+static void update_mbr_aliases(struct partition_table *t)
+{
+    if (t->aliases_stale)
+        create_mbr_alias_table(t);
+}
+
+static bool mbr_synced(struct partition_table *t)
+{
+    update_mbr_aliases(t);
+    return t->options.mbr_sync;
+}
+
+static unsigned long partition_sectors(struct partition_table *t)
+{
+    return divide_round_up(t->header->partition_entry_size * t->header->partition_entries, t->dev->sector_size);
+}
+
+// What the functions that make tables return when they can't: a table without a header. errno says why.
+static struct partition_table no_table(struct partition_table *t)
+{
+    int error = errno;
+    free_table(t);
+    errno = error;
+    return (struct partition_table) {};
+}
+
+static struct partition_table blank_table(struct device *dev)
+{
+    GUID disk_guid = guid_create();
+    if (guid_eq(bad_guid, disk_guid))
+        return (struct partition_table) {};
+    struct partition_table t = {};
+    t.dev = dev;
+    t.header = alloc_sectors(dev, 1);
+    t.alt_header = alloc_sectors(dev, 1);
+    const int partitions = 128;
+    const int partition_sectors = divide_round_up(partitions * sizeof(struct gpt_partition), dev->sector_size);
+    *t.header = (struct gpt_header) {
+               .signature = "EFI PART",
+               .revision = PARTITION_REVISION,
+               .header_size = sizeof(struct gpt_header),
+               .my_lba = 1,
+               .alternate_lba = dev->sector_count-1,
+               .first_usable_lba = 2                  + partition_sectors,
+               .last_usable_lba = dev->sector_count-2 - partition_sectors,
+               .disk_guid = disk_guid,
+               .partition_entry_lba = 2,
+               .partition_entries = partitions,
+               .partition_entry_size = sizeof(struct gpt_partition),
+    };
+
+    *t.alt_header = *t.header;
+    t.alt_header->alternate_lba       = t.header->my_lba;
+    t.alt_header->my_lba              = t.header->alternate_lba;
+    t.alt_header->partition_entry_lba = t.header->last_usable_lba + 1;
+
+    t.partition = alloc_sectors(dev, partition_sectors);
+
+    for (int i=0; i<lengthof(t.alias); i++)
+        t.alias[i] = -1;
+
+    return t;
+}
+
+static void table_changed(struct partition_table *t)
+{
+    t->generation++;
+    t->crc_stale = true; // Most changes touch something the CRCs cover. Recomputing them later is cheap if not.
+}
+
+// Swap in a whole new table for |t|, remembering that it's now different from what's on the disk.
+static void replace_table(struct partition_table *t, struct partition_table new)
+{
+    new.generation = t->generation + 1;
+    new.clean_generation = t->clean_generation;
+    new.crc_stale = true;
+    new.settings = t->settings;
+    free_table(t);
+    *t = new;
+}
+
+static int command_clear_table(struct partition_table *t, char **arg)
+{
+    struct partition_table blank = blank_table(t->dev);
+    if (!blank.header)
+        return errno;
+    blank.mbr = t->mbr;
+    replace_table(t, blank);
+    return 0;
+}
+command_add("clear-table", command_clear_table, "Clear out GPT partition table for a nice fresh start.");
+
+static bool blank_mbr(struct device *dev, struct mbr *mbr)
+{
+    // Even a blank MBR should preserve the boot code.
+    struct mbr code;
+    if (!read_mbr(dev, &code))
+        return false;
+    *mbr = (struct mbr) { .mbr_signature = MBR_SIGNATURE };
+    memcpy(mbr->code, code.code, sizeof(mbr->code));
+    return true;
+}
+
+static int command_clear_mbr(struct partition_table *t, char **arg)
+{
+    if (!blank_mbr(t->dev, &t->mbr))
+        return errno;
+    mbr_aliases_changed(t);
+    table_changed(t);
+    return 0;
+}
+command_add("clear-mbr", command_clear_mbr, "Clear out MBR partition table and start anew.");
+
+static int command_create_protective_mbr(struct partition_table *t, char **arg)
+{
+    if (!blank_mbr(t->dev, &t->mbr))
+        return errno;
+    t->mbr.partition[0] = (struct mbr_partition) {
+        .first_sector_lba = 1,
+        .sectors = t->dev->sector_count-1,
+        .partition_type = 0xee,
+    };
+    mbr_aliases_changed(t);
+    table_changed(t);
+    return 0;
+}
+command_add("create-protective-mbr", command_create_protective_mbr, "Replace MBR entries with a protective MBR as per the EFI spec.");
+
+static int command_add_protective_mbr_partition(struct partition_table *t, char **arg)
+{
+    for (int i=0; i < lengthof(t->mbr.partition); i++)
+        if (t->mbr.partition[i].partition_type == 0) {
+            t->mbr.partition[i] = (struct mbr_partition) {
+                .first_sector_lba = 1,
+                .sectors = t->header->first_usable_lba-1-1/*mbr*/,
+                .partition_type = 0xee,
+            };
+            mbr_aliases_changed(t);
+            table_changed(t);
+            return 0;
+        }
+    fprintf(stderr, "No free MBR partitions found.\n");
+    return ENOSPC;
+}
+command_add("add-protective-mbr-partition", command_add_protective_mbr_partition, "Add a protective MBR entry that just covers the EFI partitioning sectors.");
+
+static struct partition_table gpt_table_from_mbr(struct mbr *mbr, struct device *dev)
+{
+    struct partition_table t = blank_table(dev);
+    if (!t.header)
+        return t;
+    t.mbr = *mbr;
+    for (int mp=0,gp=0; mp<lengthof(t.mbr.partition); mp++) {
+        if (t.mbr.partition[mp].partition_type) {
+            if (t.mbr.partition[mp].partition_type == 0xee)
+                continue;
+
+            t.partition[gp].first_lba = t.mbr.partition[mp].first_sector_lba;
+            t.partition[gp].last_lba  = t.mbr.partition[mp].first_sector_lba + t.mbr.partition[mp].sectors - 1;
+
+            if (t.partition[gp].first_lba < t.header->first_usable_lba ||
+                t.partition[gp].last_lba > t.header->last_usable_lba)
+                printf("ouch, mbr partition %d [%"PRId64"d,%"PRId64"d] outside of usable gpt space [%"PRId64"d,%"PRId64"d]\n",
+                       mp+1, t.partition[gp].first_lba, t.partition[gp].last_lba, t.header->first_usable_lba, t.header->last_usable_lba);
+
+            char name[sizeof("MBR 4\n")];
+            snprintf(name, sizeof(name), "MBR %d\n", mp+1);
+            utf16_from_ascii(t.partition[gp].name, name, lengthof(t.partition[gp].name));
+
+            t.partition[gp].partition_type = partition_type_from_mbr(t.mbr.partition[mp].partition_type);
+            if (guid_eq(t.partition[gp].partition_type, gpt_partition_type_empty))
+                // Not found, use gdisk specific guid to mean "unknown".
+                t.partition[gp].partition_type = GUID(b334117e,118d,11de,9b0f,001cc0952d53);
+
+            t.partition[gp].partition_guid = guid_create();
+            if (guid_eq(bad_guid, t.partition[gp].partition_guid))
+                return no_table(&t);
+            t.alias[mp] = gp++;
+        }
+    }
+    t.options.mbr_sync = true;
+    return t;
+}
+static int gpt_from_mbr(struct partition_table *t, char **arg)
+{
+    struct partition_table new_table = gpt_table_from_mbr(&t->mbr, t->dev);
+    if (!new_table.header)
+        return errno;
+    replace_table(t, new_table);
+    return 0;
+}
+command_add("init-gpt-from-mbr", gpt_from_mbr, "(Re)create GPT partition table using data from the MBR partition table");
+
+static int recreate_gpt(struct partition_table *t, char **arg)
+{
+    struct partition_table new_table = blank_table(t->dev);
+    if (!new_table.header)
+        return errno;
+    new_table.header->disk_guid = new_table.alt_header->disk_guid = t->header->disk_guid;
+    assert(new_table.header->partition_entries == t->header->partition_entries);
+    /* Should never happen because for now all gpt partitions have the same number of entries: */
+    if (new_table.header->partition_entries < t->header->partition_entries)
+        fprintf(stderr, "Warning: new partition table has less partition entries (%d) than the old table (%d). Some partitions may be dropped.\n",
+                new_table.header->partition_entries, t->header->partition_entries);
+    struct gpt_header *header = t->header, *alt_header = t->alt_header;
+    t->header = new_table.header;
+    t->alt_header = new_table.alt_header;
+    new_table.header = header;
+    new_table.alt_header = alt_header;
+    free_table(&new_table);
+    extents_changed(t); // The usable area may have moved.
+    table_changed(t);
+    return 0;
+}
+command_add("recreate-gpt", recreate_gpt, "Recreate GPT partition table using partitions in current GPT. Useful for resizing disks.");
+
+// Returns |sectors| sectors starting at |sector|, copied out of one of the |read_ahead| buffers if it's covered by one,
+// and read from the disk otherwise. NULL if the read fails.
+static void *read_sectors(struct device *dev, struct device_io *read_ahead, int read_aheads, unsigned long long sector, unsigned long sectors)
+{
+    for (int r=0; r<read_aheads; r++)
+        if (sector >= read_ahead[r].sector && sector + sectors <= read_ahead[r].sector + read_ahead[r].sectors)
+            return memcpy(alloc_sectors(dev, sectors), read_ahead[r].buffer + (sector - read_ahead[r].sector) * dev->sector_size,
+                          sectors * dev->sector_size);
+    return get_sectors(dev, sector, sectors);
+}
+
+// Returns a table without a header (see no_table()) if a read fails.
+static struct partition_table read_gpt_table_using(struct device *dev, struct device_io *read_ahead, int read_aheads)
+{
+    struct partition_table t = {};
+    t.dev = dev;
+
+    bool primary_valid = true, alternate_valid = true;
+
+#define header_error(format, ...) ({                        \
+            fprintf(stderr, format, ##__VA_ARGS__);         \
+            fprintf(stderr, ". Assuming blank partition...\n");   \
+            free_table(&t);                                 \
+            t = blank_table(dev);                           \
+            table_changed(&t); /* Doesn't match the disk */ \
+            t;                                              \
+        })
+
+#define header_warning(format, ...) ({              \
+            fprintf(stderr, "Warning: ");           \
+            fprintf(stderr, format, ##__VA_ARGS__); \
+            fprintf(stderr, ".\n");                 \
+        })
+
+#define header_corrupt(which, format, ...) ({                             \
+        header_warning(format, ##__VA_ARGS__);                            \
+        which ## _valid = false;                                          \
+        if (!primary_valid && !alternate_valid)                           \
+            return header_error("There were no valid GPT headers found"); \
+        })
+
+#define read_or_fail(sector, sectors) ({                                               \
+            void *data = read_sectors(dev, read_ahead, read_aheads, sector, sectors); \
+            if (!data)                                                                 \
+                return no_table(&t);                                                   \
+            data;                                                                      \
+        })
+
+    t.header = read_or_fail(1, 1);
+
+    if (memcmp(t.header->signature, "EFI PART", sizeof(t.header->signature)) != 0)
+        header_corrupt(primary, "Missing signature in primary GPT header");
+    else
+        gpt_header_to_host(t.header);
+
+    t.alt_header = read_or_fail(primary_valid ? t.header->alternate_lba : dev->sector_count-1, 1);
+
+    if (memcmp(t.alt_header->signature, "EFI PART", sizeof(t.alt_header->signature)) != 0)
+        header_corrupt(alternate, "Missing signature in altername GPT header");
+    else
+        gpt_header_to_host(t.alt_header);
+
+    if (primary_valid && t.header->header_size != sizeof(struct gpt_header))
+        header_corrupt(primary, "Partition header is %d bytes long instead of %zd", t.header->header_size, sizeof(struct gpt_header));
+
+    if (alternate_valid && t.alt_header->header_size != sizeof(struct gpt_header))
+        header_corrupt(alternate, "Partition header is %d bytes long instead of %zd", t.header->header_size, sizeof(struct gpt_header));
+
+    if (primary_valid && t.header->partition_entry_size != sizeof(struct gpt_partition))
+        header_corrupt(primary, "Size of partition entries are %d instead of %zd", t.header->partition_entry_size, sizeof(struct gpt_partition));
+
+    if (alternate_valid && t.alt_header->partition_entry_size != sizeof(struct gpt_partition))
+        header_corrupt(alternate, "Size of partition entries are %d instead of %zd", t.alt_header->partition_entry_size, sizeof(struct gpt_partition));
+
+    uint64_t primary_lba,alternate_lba;
+    if (primary_valid && alternate_valid && t.header->my_lba != t.alt_header->alternate_lba) {
+        header_warning("Header LBA is %"PRId64" but alternate header claims it is %"PRId64"", t.header->my_lba, t.header->alternate_lba);
+        if (t.header->my_lba == 1 || t.alt_header->alternate_lba == 1)
+            primary_lba = 1; // It *really* should be one.
+        else
+            primary_lba = t.header->my_lba; // In any other screwball case, trust the primary header.
+    } else
+        primary_lba = primary_valid ? t.header->my_lba : t.alt_header->alternate_lba;
+
+    if (primary_lba != 1)
+        header_warning("Header LBA is %"PRId64" and not 1", primary_lba);
+
+    if (primary_valid && alternate_valid && t.header->alternate_lba != t.alt_header->my_lba) {
+        header_warning("Primary header says Alternate header LBA is %"PRId64" but alternate header claims it is %"PRId64"", t.header->alternate_lba, t.header->my_lba);
+        if (t.header->my_lba == dev->sector_count-1 || t.alt_header->alternate_lba == dev->sector_count-1)
+            alternate_lba = dev->sector_count-1;
+        else
+            alternate_lba = t.header->alternate_lba; // In any other screwball case, trust the primary header.
+    } else
+        alternate_lba = primary_valid ? t.header->alternate_lba : t.alt_header->my_lba;
+
+    if (alternate_lba != dev->sector_count-1)
+        header_warning("Alternate header LBA is %"PRId64" and not at the end of the disk (LBA: %llu)", alternate_lba, dev->sector_count-1);
+
+    // Technically we can guess the start lba and check the validity of the opposite table if the one we're looking at doesn't CRC..
+    if (primary_valid) {
+        if (t.header->partition_entries * t.header->partition_entry_size / dev->sector_size > dev->sector_count/2)
+            header_corrupt(primary, "The number of partition_entries is ludicrous: %d", t.header->partition_entries);
+        else {
+            t.partition = read_or_fail(t.header->partition_entry_lba, divide_round_up(t.header->partition_entry_size * t.header->partition_entries,dev->sector_size));
+            gpt_partition_to_host(t.partition, t.header->partition_entries);
+
+            if (!gpt_crc_valid(t.header, t.partition)) {
+                header_warning("Header CRC is not valid. Fixing.");
+                table_changed(&t);
+            }
+        }
+    } else if (alternate_valid) {
+        if (t.alt_header->partition_entries * t.alt_header->partition_entry_size / dev->sector_size > dev->sector_count/2)
+            header_corrupt(alternate, "The number of partition_entries is ludicrous: %d", t.alt_header->partition_entries);
+        else {
+            t.partition = read_or_fail(t.alt_header->partition_entry_lba, divide_round_up(t.alt_header->partition_entry_size * t.alt_header->partition_entries,dev->sector_size));
+            gpt_partition_to_host(t.partition, t.alt_header->partition_entries);
+
+            if (!gpt_crc_valid(t.alt_header, t.partition)) {
+                header_warning("Alt Header CRC is not valid. Fixing.");
+                table_changed(&t);
+            }
+        }
+    }
+
+    #warning "TODO: Sanity check first_usable_lba and last_usable_lba."
+
+    // If one is bad, fix it from the other one...
+    if (primary_valid && !alternate_valid) {
+        *t.alt_header = *t.header;
+        uint64_t temp = t.alt_header->my_lba;
+        t.alt_header->my_lba = t.alt_header->alternate_lba;
+        t.alt_header->alternate_lba = temp;
+        t.alt_header->partition_entry_lba = t.alt_header->last_usable_lba + 1;
+        table_changed(&t);
+    } else if (!primary_valid && alternate_valid) {
+        *t.header = *t.alt_header;
+        uint64_t temp = t.header->my_lba;
+        t.header->my_lba = t.header->alternate_lba;
+        t.header->alternate_lba = temp;
+        t.header->partition_entry_lba = t.header->my_lba + 1;
+        table_changed(&t);
+    }
+
+    #warning "TODO: Capture both sets of partition tables in case on has a bad crc."
+
+    return t;
+}
+
+static int read_gpt_table(struct device *dev, struct partition_table *t)
+{
+    // Tables are almost always laid out the way blank_table() does it, so guess that and read the front and the back of
+    // the disk at the same time instead of seeking to the alternate header only after the primary one says where it is.
+    // Anything outside the guess is read from the disk when it's needed.
+    const unsigned long guess_sectors = 1 + divide_round_up(128 * sizeof(struct gpt_partition), dev->sector_size);
+    struct device_io read_ahead[] = {
+        { .sector = 1,                                 .sectors = guess_sectors }, // primary header, then partitions
+        { .sector = dev->sector_count - guess_sectors, .sectors = guess_sectors }, // alternate partitions, then header
+    };
+    int read_aheads = dev->sector_count > 2 * guess_sectors + 1 ? lengthof(read_ahead) : 0;
+    if (!get_sectors_batch(dev, read_ahead, read_aheads))
+        return errno;
+
+    *t = read_gpt_table_using(dev, read_ahead, read_aheads);
+    int error = t->header ? 0 : errno;
+
+    for (int r=0; r<read_aheads; r++)
+        free(read_ahead[r].buffer);
+    return error;
+}
+
+int read_table(struct device *dev, struct partition_table *t)
+{
+    int error = read_gpt_table(dev, t);
+    if (error)
+        return error;
+
+    if (!read_mbr(dev, &t->mbr)) {
+        error = errno;
+        free_table(t);
+        return error;
+    }
+
+    mbr_aliases_changed(t);
+
+    t->settings = (struct settings) { .fit = Fit_First, .align = "1M" };
+    return 0;
+}
+
+int open_table(char *name, bool direct_io, char *backend, struct partition_table *t)
+{
+    char *device_name = xstrdup(name); // open_device() takes it apart
+    errno = 0;
+    struct device *dev = open_device(device_name, direct_io, backend);
+    free(device_name);
+    if (!dev)
+        return errno ? errno : ENODEV;
+    if (dev->sector_size < 512) {
+        warnx("%s has a sector size of %lu which is not big enough to support an MBR", name, dev->sector_size);
+        close_device(dev);
+        return ENOTSUP;
+    }
+    int error = read_table(dev, t);
+    if (error)
+        close_device(dev);
+    return error;
+}
+
+#warning "TODO: Add 'fix' command that moves alternate partition and header to end of disk"
+
+void free_table(struct partition_table *t)
+{
+    free(t->header);
+    free(t->alt_header);
+    free(t->partition);
+    free(t->entry_crc);
+    free(t->extents);
+}
+
+static int compare_partition_entries(const void *_a, const void *_b)
+{
+    const struct gpt_partition *a = _a, *b = _b;
+    int a_empty = guid_eq(gpt_partition_type_empty, a->partition_type),
+        b_empty = guid_eq(gpt_partition_type_empty, b->partition_type);
+    if (a_empty || b_empty)
+        return a_empty - b_empty;
+    return (long long)a->first_lba - (long long)b->first_lba;
+}
+
+static void compact_and_sort(struct partition_table *t)
+{
+    qsort(t->partition, t->header->partition_entries, sizeof(*t->partition), compare_partition_entries);
+    partitions_changed(t);
+    mbr_aliases_changed(t);
+}
+
+static int command_compact_and_sort(struct partition_table *t, char **arg)
+{
+    compact_and_sort(t);
+    table_changed(t);
+    return 0;
+}
+command_add("compact-and-sort", command_compact_and_sort, "Remove \"holes\" from table and sort entries in ascending order");
+
+struct gpt_partition *find_unused_partition(struct partition_table *t)
+{
+    for (int i=0; i<t->header->partition_entries; i++)
+        if (guid_eq(gpt_partition_type_empty, t->partition[i].partition_type))
+            return &t->partition[i];
+    return NULL;
+}
+
+// The parts of the disk that partitions use, sorted by first_lba. new and delete keep it up to date so free space
+// questions don't need to copy and sort the whole table each time they're asked.
+struct extents {
+    int count, capacity;
+    struct free_space largest; // The biggest gap, recalculated whenever the extents change.
+    struct extent {
+        uint64_t first_lba, last_lba;
+        uint64_t end; // One past the highest last_lba up to and including this extent (a bad table can overlap).
+    } extent[];
+};
+
+static int compare_extents(const void *_a, const void *_b)
+{
+    const struct extent *a = _a, *b = _b;
+    return (a->first_lba > b->first_lba) - (a->first_lba < b->first_lba);
+}
+
+static void extents_recalculate(struct partition_table *t, int from)
+{
+    struct extents *e = t->extents;
+    uint64_t end = from ? e->extent[from-1].end : 0;
+    for (int i=from; i<e->count; i++)
+        e->extent[i].end = end = MAX(end, e->extent[i].last_lba + 1);
+
+    e->largest = (struct free_space) { .blocks = 0 };
+    struct free_space space;
+    for (int cursor=0; next_free_space(t, &cursor, &space); )
+        if (space.blocks >= e->largest.blocks)
+            e->largest = space;
+}
+
+static struct extents *used_extents(struct partition_table *t)
+{
+    if (!t->extents) {
+        int entries = t->header->partition_entries;
+        struct extents *e = t->extents = xmalloc(sizeof(*e) + sizeof(e->extent[0]) * entries);
+        e->capacity = entries;
+        e->count = 0;
+        for (int i=0; i<entries; i++)
+            if (!guid_eq(gpt_partition_type_empty, t->partition[i].partition_type))
+                e->extent[e->count++] = (struct extent) { .first_lba = t->partition[i].first_lba,
+                                                          .last_lba  = t->partition[i].last_lba };
+        qsort(e->extent, e->count, sizeof(*e->extent), compare_extents);
+        extents_recalculate(t, 0);
+    }
+    return t->extents;
+}
+
+// Call when partitions are created, deleted or moved in some way other than extent_add()/extent_remove().
+static void extents_changed(struct partition_table *t)
+{
+    free(t->extents);
+    t->extents = NULL;
+}
+
+// The index of the first extent that starts at or after |lba|.
+static int extent_search(struct extents *e, uint64_t lba)
+{
+    int lo = 0, hi = e->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (e->extent[mid].first_lba < lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void extent_add(struct partition_table *t, struct gpt_partition *p)
+{
+    struct extents *e = t->extents;
+    if (!e) return; // It'll be built from the table when it's first needed.
+    if (e->count == e->capacity) {
+        extents_changed(t);
+        return;
+    }
+    int i = extent_search(e, p->first_lba);
+    memmove(&e->extent[i+1], &e->extent[i], sizeof(*e->extent) * (e->count - i));
+    e->extent[i] = (struct extent) { .first_lba = p->first_lba, .last_lba = p->last_lba };
+    e->count++;
+    extents_recalculate(t, i);
+}
+
+static void extent_remove(struct partition_table *t, struct gpt_partition *p)
+{
+    struct extents *e = t->extents;
+    if (!e) return;
+    int i = extent_search(e, p->first_lba);
+    while (i < e->count && e->extent[i].first_lba == p->first_lba && e->extent[i].last_lba != p->last_lba)
+        i++;
+    if (i == e->count || e->extent[i].first_lba != p->first_lba) {
+        extents_changed(t); // Out of sync with the table somehow. Start over.
+        return;
+    }
+    memmove(&e->extent[i], &e->extent[i+1], sizeof(*e->extent) * (e->count - i - 1));
+    e->count--;
+    extents_recalculate(t, i);
+}
+
+// Walks the unused gaps between partitions in disk order. Start with |*cursor| = 0. Doesn't allocate anything.
+bool next_free_space(struct partition_table *t, int *cursor, struct free_space *space)
+{
+    struct extents *e = used_extents(t);
+    uint64_t first_usable = t->header->first_usable_lba,
+             end_usable   = t->header->last_usable_lba + 1;
+    while (*cursor <= e->count) {
+        int i = (*cursor)++;
+        uint64_t start = MAX(first_usable, i ? e->extent[i-1].end : 0);
+        uint64_t stop  = MIN(end_usable, i < e->count ? e->extent[i].first_lba : end_usable);
+        if (stop > start) {
+            *space = (struct free_space) { .first_lba = start, .blocks = stop - start };
+            return true;
+        }
+    }
+    return false;
+}
+
+int fit_from_string(char *s)
+{
+    for (int f=0; f<lengthof(fit_name); f++)
+        if (strcmp(s, fit_name[f]) == 0)
+            return f;
+    fprintf(stderr, "Unknown fit \"%s\". Should be \"first\", \"best\", \"worst\" or \"end\".\n", s);
+    return -1;
+}
+
+// Converts an alignment like "1M" to blocks. "physical" and "optimal" come from the device. Returns 0 if it's bad.
+static uint64_t align_blocks(struct partition_table *t, char *align)
+{
+    struct device *dev = t->dev;
+    long long bytes = strcmp(align, "physical") == 0 ? dev->physical_block_size :
+                      strcmp(align, "optimal")  == 0 ? (dev->io_opt ? dev->io_opt : dev->io_min) :
+                                                       human_size(align);
+    if (bytes <= 0) {
+        fprintf(stderr, "Bad alignment: \"%s\"\n", align);
+        return 0;
+    }
+    return divide_round_up(bytes, t->dev->sector_size);
+}
+
+// Picks a spot for a new partition of |blocks| blocks that starts on an |align| block boundary, choosing between the
+// free spaces it fits in according to |fit|. If |blocks| is 0 it picks the biggest space there is instead. Returns
+// .blocks = 0 if nothing fits.
+static struct free_space find_free_space(struct partition_table *t, uint64_t blocks, enum fit fit, uint64_t align)
+{
+    struct free_space found = { .blocks = 0 }, space;
+    uint64_t found_room = 0;
+    // Aligned LBAs are the ones that line up with the device's physical blocks, which may not start at LBA 0.
+    uint64_t offset = t->dev->alignment_offset / t->dev->sector_size % align;
+    if (blocks > used_extents(t)->largest.blocks)
+        return found; // Wouldn't fit even without aligning.
+    for (int cursor=0; next_free_space(t, &cursor, &space); ) {
+        uint64_t end   = space.first_lba + space.blocks;
+        uint64_t start = divide_round_up(space.first_lba + align - offset, align) * align + offset - align;
+        if (start >= end || end - start < blocks)
+            continue;
+        uint64_t room = end - start;
+        if (!blocks) {
+            if (room >= found.blocks)
+                found = (struct free_space) { .first_lba = start, .blocks = room };
+            continue;
+        }
+        if (!found.blocks ||
+            fit == Fit_Best  && room < found_room ||
+            fit == Fit_Worst && room > found_room ||
+            fit == Fit_End) {
+            found = (struct free_space) { .first_lba = fit == Fit_End ? round_down(end - blocks + align - offset, align) + offset - align : start,
+                                          .blocks = blocks };
+            found_room = room;
+        }
+        if (fit == Fit_First)
+            break;
+    }
+    return found;
+}
+
+
+static GUID type_guid_from_string(char *s)
+{
+    struct gpt_partition_type *type = partition_type_from_name(s);
+    return type ? type->guid : guid_from_string(s);
+}
+
+static bool sync_partition_to_mbr(struct partition_table *t, int gpt_index)
+{
+    update_mbr_aliases(t);
+    int mbr_type;
+    struct gpt_partition *p = &t->partition[gpt_index];
+    if (!partition_entry_is_representable_in_mbr(p) ||
+        !(mbr_type = find_mbr_equivalent(p->partition_type)))
+        return false;
+
+    for (int i=0; i < lengthof(t->mbr.partition); i++)
+        if (t->mbr.partition[i].partition_type == 0) {
+            t->mbr.partition[i] = (struct mbr_partition) {
+                .status = 0,
+                .first_sector = {}, // Need disk geometry to do this properly
+                .last_sector  = {}, // Need disk geometry to do this properly
+                .partition_type = mbr_type,
+                .first_sector_lba = p->first_lba,
+                .sectors = p->last_lba - p->first_lba + 1,
+            };
+            t->alias[i] = gpt_index;
+            return true;
+        }
+    return false;
+}
+
+static int command_create_partition(struct partition_table *t, char **arg)
+{
+    enum { Type=1, Size, Label, First_lba, Last_lba, System, Guid, Fit, Align };
+    struct gpt_partition part = {};
+    part.partition_type = type_guid_from_string(arg[Type]);
+    if (guid_eq(bad_guid, part.partition_type)) {
+        fprintf(stderr, "Unknown GUID format: \"%s\"\n", arg[Type]);
+        return EINVAL;
+    }
+
+    part.partition_guid = arg[Guid] ? guid_from_string(arg[Guid]) : guid_create();
+    if (!arg[Guid] && guid_eq(bad_guid, part.partition_guid))
+        return errno;
+    if (guid_eq(bad_guid, part.partition_guid)) {
+        fprintf(stderr, "Unknown GUID format: \"%s\"\n", arg[Guid]);
+        return EINVAL;
+    }
+
+    int fit = arg[Fit] ? fit_from_string(arg[Fit]) : t->settings.fit;
+    if (fit < 0)
+        return EINVAL;
+    uint64_t align = align_blocks(t, arg[Align] ? arg[Align] : t->settings.align);
+    if (!align)
+        return EINVAL;
+
+    uint64_t size = human_size(arg[Size]);
+    uint64_t blocks = divide_round_up(size, t->dev->sector_size);
+
+    if (arg[First_lba] && !size && !arg[Last_lba]) {
+        fprintf(stderr, "If you specify the first LBA then you must give a size or a last LBA.\n");
+        return EINVAL;
+    }
+    if (size && arg[Last_lba]) {
+        fprintf(stderr, "You can't give both a size and a last LBA.\n");
+        return EINVAL;
+    }
+
+    if (!size && !arg[First_lba]) {
+        struct free_space largest = find_free_space(t, 0, fit, align);
+        if (!largest.blocks) {
+            fprintf(stderr, "There is no free space left!\n");
+            return ENOSPC;
+        }
+        blocks = largest.blocks;
+        size = blocks * t->dev->sector_size;
+        part.first_lba = largest.first_lba;
+        printf("Largest unused space: %"PRId64" blocks (%"PRId64", %s) at block %"PRId64".\n",
+               blocks, size, human_string(size), part.first_lba);
+    } else if (arg[First_lba])
+        part.first_lba = strtoull(arg[First_lba], NULL, 0);
+    else {
+        struct free_space space = find_free_space(t, blocks, fit, align);
+        part.first_lba = space.blocks ? space.first_lba : -1LL;
+    }
+    if (part.first_lba == -1LL) {
+        fprintf(stderr, "Couldn't find %"PRId64" blocks (%"PRId64", %s) of free space.\n", blocks, size, human_string(size));
+        return ENOSPC;
+    }
+    part.last_lba = arg[Last_lba] ? strtoull(arg[Last_lba], NULL, 0) : part.first_lba + blocks - 1;
+    part.attributes = 0 | (arg[System] ? PA_SYSTEM_PARTITION : 0);
+    utf16_from_ascii(part.name, arg[Label] ? arg[Label] : "", lengthof(part.name));
+
+    if (part.last_lba < part.first_lba) {
+        fprintf(stderr, "Last LBA (%"PRIu64") must be larger than the Start LBA (%"PRIu64")\n", part.last_lba, part.first_lba);
+        return EINVAL;
+    }
+
+    if (part.first_lba < t->header->first_usable_lba) {
+        fprintf(stderr, "First LBA (%"PRIu64") must be greater (or equal) to the First Usable LBA (%"PRIu64")\n", part.first_lba, t->header->first_usable_lba);
+        return EINVAL;
+    }
+
+    if (part.last_lba > t->header->last_usable_lba) {
+        fprintf(stderr, "Last LBA (%"PRIu64") must be smaller than the Last Usable LBA (%"PRIu64")\n", part.last_lba, t->header->last_usable_lba);
+        return EINVAL;
+    }
+
+    dump_partition(&part);
+
+    struct gpt_partition *p = find_unused_partition(t);
+    if (!p) {
+        fprintf(stderr, "Partition table is full.\n");
+        return ENOSPC;
+    }
+
+    bool synced = mbr_synced(t); // Before the new entry can line up with a stale MBR entry and look like it's synced
+    *p = part;
+
+    partition_changed(t, p - t->partition);
+    extent_add(t, p);
+
+    if (!device_lbas_aligned(t->dev, p->first_lba, p->last_lba))
+        fprintf(stderr, "Warning: Partition %d doesn't line up with the %ld byte physical blocks on %s. Writes to it will be slow.\n",
+                (int)(p - t->partition), t->dev->physical_block_size, t->dev->name);
+
+    if (synced)
+        sync_partition_to_mbr(t, p - t->partition);
+    else
+        mbr_aliases_changed(t);
+
+    table_changed(t);
+    return 0;
+}
+
+command_add("new", command_create_partition, "Create a new partition entry in the table",
+            command_arg("type",      C_Partition_Type,    "Type of new partition"),
+            command_arg("size",      C_FreeSpace,         "Size of the new partition"),
+            command_arg("label",     C_String|C_Optional, "The name of the new partition"),
+            command_arg("first_lba", C_String|C_Optional, "The first block of the new partition"),
+            command_arg("last_lba",  C_String|C_Optional, "The last block of the new partition (this overrides the size argument)"),
+            command_arg("system",    C_Flag,              "Set the \"System Partition\" attribute"),
+            command_arg("guid",      C_String|C_Optional, "The GUID of the new partition"),
+            command_arg("fit",       C_String|C_Optional, "Which free space to use: the \"first\" one it fits in, the \"best\" (smallest) or \"worst\" (biggest) fit, or the \"end\" of the disk"),
+            command_arg("align",     C_String|C_Optional, "Start the partition on a multiple of this size, or the device's \"physical\" block or \"optimal\" I/O size (default 1M)")
+            );
+
+static int get_mbr_alias(struct partition_table *t, int index)
+{
+    update_mbr_aliases(t);
+    for (int m=0; m<lengthof(t->alias); m++)
+        if (t->alias[m] == index)
+            return m;
+    return -1;
+}
+
+static void delete_mbr_partition(struct partition_table *t, int mbr_index)
+{
+    update_mbr_aliases(t);
+    memset(&t->mbr.partition[mbr_index], 0, sizeof(*t->mbr.partition));
+    t->alias[mbr_index] = -1;
+}
+
+static int choose_partition(struct partition_table *t, char *string)
+{
+    int index = strtol(string, NULL, 0);
+    if (index < 0 || index >= t->header->partition_entries) {
+        fprintf(stderr, "Bad index '%d'. Should be between 0 and %d (inclusive).\n", index, t->header->partition_entries-1);
+        return -1;
+    }
+    if (guid_eq(t->partition[index].partition_type, gpt_partition_type_empty)) {
+        fprintf(stderr, "Partition '%d' is empty.\n", index);
+        return -1;
+    }
+    return index;
+}
+
+static int command_delete_partition(struct partition_table *t, char **arg)
+{
+    int index = choose_partition(t, arg[1]);
+    if (index < 0) return EINVAL;
+
+    // The aliases are worked out lazily from the entries, so ask before the entry is gone.
+    int mbr_alias = get_mbr_alias(t, index);
+    bool synced = mbr_synced(t);
+
+    extent_remove(t, &t->partition[index]);
+    memset(&t->partition[index], 0, sizeof(t->partition[index]));
+    partition_changed(t, index);
+    if (synced && mbr_alias != -1)
+        delete_mbr_partition(t, mbr_alias);
+    table_changed(t);
+    return 0;
+}
+
+command_add("delete", command_delete_partition, "Delete a partition from the table",
+            command_arg("index",     C_Number, "The index number of the partition. The first partition is partition zero"));
+
+static int command_sync_mbr(struct partition_table *t, char **arg)
+{
+    if (mbr_synced(t) && !arg[1]) {
+        fprintf(stderr, "MBR is already synced to GPT. Use --force flag to force a re-sync.\n");
+        return EEXIST;
+    }
+    for (int i=0; i < lengthof(t->mbr.partition); i++)
+        delete_mbr_partition(t, i);
+
+    for (int i=0; i < t->header->partition_entries; i++)
+        sync_partition_to_mbr(t, i);
+
+    t->options.mbr_sync = true;
+    table_changed(t);
+    return 0;
+}
+command_add("init-mbr-from-gpt", command_sync_mbr, "(Re)create MBR partition table using data from the GPT partition table",
+            command_arg("force",     C_Flag, "Force a re-sync if the MBR already looks synced"));
+
+static int command_sync_mbr_partition(struct partition_table *t, char **arg)
+{
+    int index = choose_partition(t, arg[1]);
+    if (index < 0) return EINVAL;
+
+    if (!sync_partition_to_mbr(t, index)) {
+        fprintf(stderr, "Error syncing partition %d.\n", index);
+        return -1;
+    }
+
+    table_changed(t);
+    return 0;
+}
+command_add("init-mbr-partition-from-gpt", command_sync_mbr_partition, "Create a single MBR partition using data from a GPT partition",
+            command_arg("gpt-partition-index", C_Number, "The index number of the source GPT partition. The first partition is partition zero")/*,
+            command_arg("mbr-partition-index", C_Number|C_Optional, "The index number of the destination MBR partition. The first partition is zero.")*/);
+
+static int command_edit(struct partition_table *t, char **arg)
+{
+    int index = choose_partition(t, arg[1]);
+    if (index < 0) return EINVAL;
+
+    // Check everything up front so a bad argument doesn't leave the entry half edited.
+    GUID type = arg[2] ? type_guid_from_string(arg[2]) : bad_guid;
+    if (arg[2] && guid_eq(bad_guid, type)) {
+        fprintf(stderr, "Not a valid type string or unknown GUID format: \"%s\"\n", arg[2]);
+        return EINVAL;
+    }
+    GUID guid = arg[4] ? guid_from_string(arg[4]) : bad_guid;
+    if (arg[4] && guid_eq(bad_guid, guid)) {
+        fprintf(stderr, "Bad GUID: \"%s\"\n", arg[4]);
+        return EINVAL;
+    }
+
+    if (arg[2]) {
+        int mbr_alias = get_mbr_alias(t, index); // Before the type changes, as in delete.
+        bool synced = mbr_synced(t);
+        t->partition[index].partition_type = type;
+        if (guid_eq(gpt_partition_type_empty, type)) { // Effectively a delete.
+            extents_changed(t);
+            mbr_aliases_changed(t);
+        }
+
+        int mbr_type = find_mbr_equivalent(type);
+        if (synced && mbr_alias != -1 && mbr_type)
+            t->mbr.partition[mbr_alias].partition_type = mbr_type;
+    }
+
+    if (arg[3])
+        utf16_from_ascii(t->partition[index].name, arg[3], lengthof(t->partition[index].name));
+
+    if (arg[4])
+        t->partition[index].partition_guid = guid;
+
+    if (arg[2] || arg[3] || arg[4]) {
+        partition_changed(t, index);
+        table_changed(t);
+    }
+    return 0;
+}
+command_add("edit", command_edit, "Change parts of a partition",
+            command_arg("index",     C_Number,                    "The index number of the partition. The first partitiion is partition zero"),
+            command_arg("type",      C_Partition_Type|C_Optional, "Type of partition"),
+            command_arg("label",     C_String|C_Optional,         "The name of the new partition"),
+            command_arg("guid",      C_String|C_Optional,         "The GUID of the new partition"));
+
+static int command_regenerate_guids(struct partition_table *t, char **arg)
+{
+    bool disk = !arg[1];
+    bool *selected = dcalloc(t->header->partition_entries, sizeof(*selected));
+    int count = disk;
+    if (!arg[1]) {
+        for (int i=0; i<t->header->partition_entries; i++)
+            if (!guid_eq(t->partition[i].partition_type, gpt_partition_type_empty))
+                count += selected[i] = true;
+    } else {
+        // Check the whole list before changing anything.
+        char *rest = dstrdup(arg[1]);
+        for (char *item; (item = strsep(&rest, ","));) {
+            if (strcmp(item, "disk") == 0) {
+                count += !disk;
+                disk = true;
+                continue;
+            }
+            int index = choose_partition(t, item);
+            if (index < 0) return EINVAL;
+            count += !selected[index];
+            selected[index] = true;
+        }
+    }
+
+    GUID *guid = dcalloc(count, sizeof(*guid));
+    if (!guid_create_batch(guid, count))
+        return errno;
+    if (disk)
+        t->header->disk_guid = t->alt_header->disk_guid = *guid++;
+    for (int i=0; i<t->header->partition_entries; i++)
+        if (selected[i]) {
+            t->partition[i].partition_guid = *guid++;
+            partition_changed(t, i);
+        }
+    table_changed(t);
+    return 0;
+}
+command_add("regenerate-guids", command_regenerate_guids, "Give the disk and its partitions new random GUIDs (do this after copying a disk image)",
+            command_arg("partitions", C_String|C_Optional, "Comma separated partition indexes to change, and/or \"disk\" for the disk GUID (default: the disk and every partition)"));
+
+static int command_edit_attributes(struct partition_table *t, char **arg)
+{
+    int index = choose_partition(t, arg[1]);
+    if (index < 0) return EINVAL;
+
+    uint64_t val = strcmp(arg[3], "system") == 0 ? PA_SYSTEM_PARTITION : strtoull(arg[3], NULL, 0);
+
+    if      (strcmp(arg[2], "set") == 0)
+        t->partition[index].attributes |=  val;
+    else if (strcmp(arg[2], "clear") == 0)
+        t->partition[index].attributes &= ~val;
+    else {
+        fprintf(stderr, "command \"%s\" is not \"set\" or \"clear\".\n", arg[2]);
+        return EINVAL;
+    }
+    partition_changed(t, index);
+    table_changed(t);
+    printf("Attributes is now %"PRIx64" after %s %016"PRIx64"\n",
+           t->partition[index].attributes, strcmp(arg[2], "set") == 0 ? "setting" : "clearing", val);
+
+    return 0;
+}
+command_add("edit-attributes", command_edit_attributes, "Set or clear attribute bits of a partition",
+            command_arg("index",      C_Number, "The index number of the partition. The first partitiion is partition zero"),
+            command_arg("command",    C_String, "\"set\" or \"clear\" -- what you want to do to the bits"),
+            command_arg("attributes", C_String, "The bits you want to set or clear as a number (or \"system\" for \"System Partition\" attribute)"));
+
+
+static int command_edit_mbr(struct partition_table *t, char **arg)
+{
+    int index = strtol(arg[1], NULL, 0);
+    if (index < 0 || index >= 4) {
+        fprintf(stderr, "Bad index '%d'. Should be between 0 and %d (inclusive).\n", index, 3);
+        return -1;
+    }
+    t->mbr.partition[index].partition_type = strtoul(arg[2], NULL, 16);
+    mbr_aliases_changed(t); // It might have gotten out of sync.
+    table_changed(t);
+    return 0;
+}
+command_add("edit-mbr", command_edit_mbr, "Change details of an MBR partition",
+            command_arg("index",      C_Number, "The index number of the MBR partition. The first partitiion is partition zero"),
+            command_arg("type",       C_Number, "Type of partition (in hex)"));
+
+// The alternate GPT goes out first, then the primary, then the MBR. If we lose power part way through there's
+// always one complete GPT on the disk: the old primary while the alternate is being written, and the new
+// alternate while the primary is.
+enum write_stage { Stage_Alternate_GPT, Stage_Primary_GPT, Stage_MBR, Stages };
+
+struct write_vec {
+    void *buffer;
+    unsigned long long block;
+    unsigned long long blocks;
+    char *name;
+    enum write_stage stage; // Each stage is written and flushed before the next one starts.
+};
+
+struct write_image {
+    struct write_vec vec[10];
+    int count;
+};
+
+struct write_image image_from_table(struct partition_table *t)
+{
+    struct write_image image = { .count = 5 };
+
+    // *.front: mbr, then gpt header, then partitions
+    image.vec[0] = (struct write_vec) {
+        .buffer = sector_from_mbr(t->dev, &t->mbr),
+        .block  = 0,
+        .blocks = 1,
+        .name = xstrdup("mbr"),
+        .stage = Stage_MBR,
+    };
+
+    void *buffer = alloc_sectors(t->dev, 1);
+    gpt_header_to_disk(buffer, t->header);
+
+    image.vec[1] = (struct write_vec) {
+        .buffer = buffer,
+        .block  = t->header->my_lba,
+        .blocks = 1,
+        .name = xstrdup("gpt_header"),
+        .stage = Stage_Primary_GPT,
+    };
+
+    buffer = alloc_sectors(t->dev, partition_sectors(t));
+    gpt_partition_to_disk(buffer, t->partition, t->header->partition_entries);
+
+    image.vec[2] = (struct write_vec) {
+        .buffer = buffer,
+        .block  = t->header->partition_entry_lba,
+        .blocks = partition_sectors(t),
+        .name = xstrdup("gpt_partitions"),
+        .stage = Stage_Primary_GPT,
+    };
+
+    image.vec[3] = (struct write_vec) {
+        .buffer = memcpy(alloc_sectors(t->dev, partition_sectors(t)), buffer, partition_sectors(t) * t->dev->sector_size),
+        .block  = t->alt_header->partition_entry_lba,
+        .blocks = partition_sectors(t),
+        .name = xstrdup("alt_gpt_partitions"),
+        .stage = Stage_Alternate_GPT,
+    };
+
+    buffer = alloc_sectors(t->dev, 1);
+    gpt_header_to_disk(buffer, t->alt_header);
+
+    image.vec[4] = (struct write_vec) {
+        .buffer = buffer,
+        .block  = t->alt_header->my_lba,
+        .blocks = 1,
+        .name = xstrdup("alt_gpt_header"),
+        .stage = Stage_Alternate_GPT,
+    };
+
+    return image;
+}
+
+static struct write_vec *find_vec_in_image(struct write_image *image, char *name)
+{
+    for (int i=0; i<image->count; i++)
+        if (strcmp(image->vec[i].name, name) == 0)
+            return &image->vec[i];
+    return NULL;
+}
+
+static struct partition_table table_from_image(struct write_image image, struct device *dev)
+{
+    struct partition_table t = blank_table(dev);
+    if (!t.header)
+        return t;
+
+#define find_vec(vec_name, vec_blocks) ({                               \
+            struct write_vec *vec = find_vec_in_image(&image, vec_name); \
+            if (!vec) {                                                 \
+                fprintf(stderr, "Image is missing %s section.\n", vec_name); \
+                free_table(&t);                                         \
+                return blank_table(dev);                                \
+            }                                                           \
+            if (vec->blocks != vec_blocks) {                            \
+                fprintf(stderr, "Section %s is %lu blocks instead of %"PRIu64".\n", vec_name, (unsigned long) vec_blocks, vec->blocks); \
+                free_table(&t);                                         \
+                return blank_table(dev);                                \
+            }                                                           \
+            vec;                                                        \
+        })
+
+    struct write_vec *mbr                = find_vec("mbr",                1);
+    struct write_vec *gpt_header         = find_vec("gpt_header",         1);
+    struct write_vec *alt_gpt_header     = find_vec("alt_gpt_header",     1);
+
+    t.mbr = mbr_from_sector(mbr->buffer);
+
+    memcpy(t.header, gpt_header->buffer, sizeof(t.header));
+    gpt_header_to_host(t.header);
+
+    memcpy(t.alt_header, alt_gpt_header->buffer, sizeof(t.alt_header));
+    gpt_header_to_host(t.alt_header);
+
+    struct write_vec *gpt_partitions     = find_vec("gpt_partitions",     partition_sectors(&t));
+    //struct write_vec *alt_gpt_partitions = find_vec("alt_gpt_partitions", partition_sectors(&t));
+
+    free(t.partition); // May be a different length, so reallocate it.
+    t.partition = xmemdup(gpt_partitions->buffer, sizeof(*t.partition) * t.header->partition_entries);
+    gpt_partition_to_host(t.partition, t.header->partition_entries);
+
+    mbr_aliases_changed(&t);
+
+    return t;
+}
+
+void free_image(struct write_image image)
+{
+    for (int i=0; i < image.count; i++) {
+        free(image.vec[i].buffer);
+        free(image.vec[i].name);
+    }
+}
+
+static int export_image(struct write_image image, struct device *dev, char *filename)
+{
+    FILE *info = NULL, *data = NULL;
+    int err = 0;
+    if ((data = fopen(dsprintf("%s.data", filename), "wb")) == NULL) { err = errno; warn("Couldn't open %s.data", filename); goto done; }
+    if ((info = fopen(dsprintf("%s.info", filename), "w"))  == NULL) { err = errno; warn("Couldn't open %s.info", filename); goto done; }
+
+    fprintf(info, "# sector_size: %ld\n", dev->sector_size);
+    fprintf(info, "# sector_count: %lld\n", dev->sector_count);
+    fprintf(info, "# device: %s\n", dev->name);
+
+    unsigned skip=0;
+    for (int i=0; i < image.count; i++) {
+        int wrote = fwrite(image.vec[i].buffer, dev->sector_size, image.vec[i].blocks, data);
+        if (wrote != image.vec[i].blocks) {
+            err = errno;
+            warn("Couldn't write %s to %s.data", image.vec[i].name, filename);
+            goto done;
+        }
+        fprintf(info, "# %s:\ndd if=\"%s.data\" of=\"%s\" bs=%ld skip=%d seek=%lld count=%lld\n",
+                image.vec[i].name,
+                filename, dev->name, dev->sector_size,
+                skip, image.vec[i].block, image.vec[i].blocks);
+        skip += image.vec[i].blocks;
+    }
+
+  done:
+    if (data) fclose(data);
+    if (info) fclose(info);
+    return err;
+}
+
+static int export_table(struct partition_table *t, char *filename)
+{
+    struct write_image image = image_from_table(t);
+    int status = export_image(image, t->dev, filename);
+    free_image(image);
+    return status;
+}
+
+int command_export(struct partition_table *t, char **arg)
+{
+    update_table_crc(t);
+    return export_table(t, arg[1]);
+}
+command_add("export", command_export, "Save table to a file (not to a device)",
+            command_arg("filename", C_File, "Filename to as a base use for exported files"));
+
+static int import_image(struct write_image *image_out, struct device *dev, char *filename)
+{
+    struct write_image image = { .count = 0 };
+    FILE *info = NULL, *data = NULL;
+    int err = 0;
+    if ((data = fopen(dsprintf("%s.data", filename), "rb")) == NULL) { err = errno; warn("Couldn't open %s.data", filename); goto done; }
+    if ((info = fopen(dsprintf("%s.info", filename), "r"))  == NULL) { err = errno; warn("Couldn't open %s.info", filename); goto done; }
+
+    unsigned long sector_size=0;
+    unsigned long long sector_count=0;
+    char device[1000]="";
+
+    char line[1000];
+    char section[20];
+
+    while(fgets(line, sizeof(line), info)) {
+        if (!sector_size && sscanf(line, "# sector_size: %ld", &sector_size) == 1 && sector_size != dev->sector_size) {
+            fprintf(stderr, "image file has a sector size of %ld but device %s wants %ld\n", sector_size, dev->name, dev->sector_size);
+            err = EINVAL;
+            goto done;
+        }
+        if (!sector_count && sscanf(line, "# sector_count: %lld", &sector_count) == 1 && sector_count != dev->sector_count) {
+            fprintf(stderr, "image file has %lld LBAs but device %s has %lld\n", sector_count, dev->name, dev->sector_count);
+            err = EINVAL;
+            goto done;
+        }
+        if (!device[0] && sscanf(line, "# device: %1000s", device) == 1 && strcmp(device,dev->name) != 0)
+            fprintf(stderr, "Warning: image file was created from %s but we're operating on %s.\n", device, dev->name);
+        if (sscanf(line, "# %20s:", section) == 1)
+            if (section[0] && section[strlen(section)-1] == ':')
+                section[strlen(section)-1] = '\0';
+        unsigned long long skip, seek;
+        unsigned long count;
+        if (sscanf(line, "dd if=\"%*s of=\"%*s bs=%*d skip=%llu seek=%llu count=%lu", &skip, &seek, &count) == 3) {
+            if (image.count == lengthof(image.vec)) {
+                err = ENOSPC;
+                printf("Too many sections in %s.info\n", filename);
+                goto done;
+            }
+            void *buf = alloc_sectors(dev, count);
+            if (fseek(data, skip*dev->sector_size, SEEK_SET)) {
+                warn("Couldn't seek to %lld in %s.data", skip*dev->sector_size, filename);
+                goto done;
+            }
+            if (fread(buf, dev->sector_size, count, data) != count) {
+                warn("Couldn't read %s from %s.data", section, filename);
+                goto done;
+            }
+            image.vec[image.count++] = (struct write_vec) {
+                .buffer = buf,
+                .block  = seek,
+                .blocks = count,
+                .name = xstrdup(section),
+            };
+        }
+    }
+
+  done:
+    if (data) fclose(data);
+    if (info) fclose(info);
+    if (!err) *image_out = image;
+    else free_image(image);
+    return err;
+}
+
+int command_import(struct partition_table *t, char **arg)
+{
+    struct write_image image = {};
+    int status = import_image(&image, t->dev, arg[1]);
+    for (int i=0; i<image.count; i++)
+        printf(" %d) %20s: %llu @ %llu\n", i, image.vec[i].name, image.vec[i].blocks, image.vec[i].block);
+    struct device *dev = t->dev;
+    struct partition_table imported = table_from_image(image, dev);
+    free_image(image);
+    if (!imported.header)
+        return errno;
+    replace_table(t, imported);
+    return status;
+}
+command_add("import", command_import, "Load table from a previously exported file",
+            command_arg("filename", C_File, "Base filename to import (don't include .info or .data)"));
+
+// Reads what is on the disk where |image| would go.
+static int image_from_image(struct write_image *on_disk_out, struct write_image image, struct device *dev)
+{
+    struct write_image on_disk = image;
+    struct device_io io[on_disk.count];
+    for (int i=0; i < on_disk.count; i++)
+        io[i] = (struct device_io) { .sector = on_disk.vec[i].block, .sectors = on_disk.vec[i].blocks };
+    if (!get_sectors_batch(dev, io, on_disk.count)) // All in flight at once, so the far end of the disk isn't a separate seek.
+        return errno;
+    for (int i=0; i < on_disk.count; i++) {
+        on_disk.vec[i].buffer = io[i].buffer;
+        on_disk.vec[i].name = xstrdup(on_disk.vec[i].name);
+    }
+    *on_disk_out = on_disk;
+    return 0;
+}
+
+static void dump_data(void *data, size_t length)
+{
+    const unsigned char zero[6/*lines*/ * 16] = { 0 };
+    unsigned char *d = data;
+    for (int i=0; i<length; i+=16) {
+        int chunk=MIN(length,i+16);
+
+        if (length-i >= sizeof(zero) && memcmp(zero, &d[i], sizeof(zero)) == 0) {
+            int zeros=0;
+            for (; i < round_down(length,16) && memcmp(zero, &d[i], 16) == 0; i+=16)
+                zeros += 16;
+            printf("    * Skipped %d zeros\n", zeros);
+            i -= 16;
+            continue;
+        }
+        
+        printf("  ");
+        for (int j=i; j<chunk; j++)
+            printf("%02x ", d[j]);
+        if (chunk%16)
+            printf("%*s", (16-chunk%16)*3, "");
+        for (int j=i; j<chunk; j++)
+            printf("%c",  isprint(d[j]) ? d[j] : '.');
+        printf("\n");
+    }
+}
+
+bool table_is_dirty(struct partition_table *t)
+{
+    return t->generation != t->clean_generation;
+}
+
+static int command_verify(struct partition_table *t, char **arg)
+{
+    update_table_crc(t);
+    struct write_image image = image_from_table(t), on_disk;
+    int status = image_from_image(&on_disk, image, t->dev);
+    if (status) {
+        free_image(image);
+        return status;
+    }
+    int differences = 0;
+    for (int i=0; i<image.count; i++)
+        if (memcmp(image.vec[i].buffer, on_disk.vec[i].buffer, image.vec[i].blocks * t->dev->sector_size) != 0) {
+            printf("%s (%"PRIu64" blocks at LBA %"PRIu64") differs from %s.\n", image.vec[i].name, image.vec[i].blocks, image.vec[i].block, t->dev->name);
+            differences++;
+        }
+    free_image(on_disk);
+    free_image(image);
+    if (!differences)
+        printf("Table matches what is on %s.\n", t->dev->name);
+    return differences ? ESTALE : 0;
+}
+command_add("verify", command_verify, "Compare the table against what is currently on the disk");
+
+static int compare_write_vec(const void *_a, const void *_b)
+{
+    const struct write_vec *a = _a, *b = _b;
+    if (a->stage != b->stage)
+        return a->stage - b->stage;
+    return a->block < b->block ? -1 : a->block > b->block;
+}
+
+// Within a stage, adjacent sections (the primary GPT header and its partitions, say) get merged and written with a
+// single call. The device is only flushed at the end of each stage, since that's the only place ordering matters.
+static int write_image(struct write_image image, struct device *dev, bool dry_run, bool verbose)
+{
+    static const char *const stage_failed[Stages] = {
+        [Stage_Alternate_GPT] = "The primary GPT on the disk has not been touched.",
+        [Stage_Primary_GPT]   = "The alternate GPT on the disk has been updated but the primary GPT is now most likely corrupt.",
+        [Stage_MBR]           = "Both GPTs on the disk have been updated but the MBR is now most likely corrupt.",
+    };
+
+    qsort(image.vec, image.count, sizeof(*image.vec), compare_write_vec);
+
+    for (int i=0, next; i<image.count; i=next) {
+        struct iovec iov[lengthof(image.vec)];
+        unsigned long long blocks = 0;
+        for (next=i; next<image.count && image.vec[next].stage == image.vec[i].stage
+                                      && image.vec[next].block == image.vec[i].block + blocks; next++) {
+            iov[next-i] = (struct iovec) { .iov_base = image.vec[next].buffer,
+                                           .iov_len  = image.vec[next].blocks * dev->sector_size };
+            blocks += image.vec[next].blocks;
+        }
+        if (dry_run || verbose)
+            printf("Writing %llu blocks to LBA %llu...\n", blocks, image.vec[i].block);
+        if (verbose)
+            for (int v=i; v<next; v++) {
+                printf("  %s:\n", image.vec[v].name);
+                dump_data(image.vec[v].buffer, image.vec[v].blocks * dev->sector_size);
+            }
+        if (!dry_run && !device_writev(dev, iov, next-i, image.vec[i].block)) {
+            int err = errno;
+            warn("Error while writing %s to %s", image.vec[i].name, dev->name);
+            fprintf(stderr, "%s\n", stage_failed[image.vec[i].stage]);
+            return err;
+        }
+
+        bool end_of_stage = next == image.count || image.vec[next].stage != image.vec[i].stage;
+        if (end_of_stage && (dry_run || verbose))
+            printf("Flushing...\n");
+        if (end_of_stage && !dry_run && !device_flush(dev)) {
+            int err = errno;
+            warn("Error while flushing %s", dev->name);
+            fprintf(stderr, "%s\n", stage_failed[image.vec[i].stage]);
+            return err;
+        }
+    }
+    return 0;
+}
+
+static int write_table(struct partition_table *t, bool force, bool dry_run, bool verbose)
+{
+    char *HOME = getenv("HOME");
+    if (!HOME) {
+        fprintf(stderr, "Couldn't find $HOME environment variable. Punting.\n");
+        if (!force) return ECANCELED;
+    }
+
+    char *dev_name = xstrdup(t->dev->name);
+
+    for (int i=0; dev_name[i]; i++)
+        if (!isalnum(dev_name[i]))
+            dev_name[i] = '_';
+
+    char backup_path[PATH_MAX];
+    snprintf(backup_path, sizeof(backup_path), "%s/.gdisk", HOME);
+    mkdir(backup_path, 0777);
+    sncatprintf(backup_path, sizeof(backup_path), "/backups");
+    mkdir(backup_path, 0777);
+    sncatprintf(backup_path, sizeof(backup_path), "/%s", dev_name);
+    time_t now = time(NULL);
+    strftime(backup_path + strlen(backup_path), sizeof(backup_path) - strlen(backup_path),
+             "-%G-%m-%d-%H-%M-%S", localtime_r(&now, &(struct tm) {}));
+    free(dev_name);
+
+    struct write_image image = image_from_table(t), backup;
+    int status = image_from_image(&backup, image, t->dev);
+    if (!status) {
+        status = export_image(backup, t->dev, backup_path);
+        free_image(backup);
+    }
+    if (status) {
+        warn("Error writing backup of table");
+        if (!force) {
+            free_image(image);
+            return ECANCELED;
+        }
+    }
+
+    int err = write_image(image, t->dev, dry_run, verbose);
+    free_image(image);
+    return err;
+}
+
+int command_write(struct partition_table *t, char **arg)
+{
+    update_table_crc(t);
+    int status = write_table(t, !!arg[1], !!arg[2], !!arg[3]);
+    if (!status && !arg[2])
+        t->clean_generation = t->generation;
+    if (status == ECANCELED) {
+        status = ENOENT; // ECANCELED will quit the program if we return it.
+        fprintf(stderr, "Table not written because a backup of the existing data could not be made.\n"
+                "Re-run with the --force option to save without a backup.\n");
+    }
+    return status;
+}
+command_add("write", command_write, "Write the partition table back to the disk",
+            command_arg("force", C_Flag, "Force table to be written even if backup cannot be saved"),
+            command_arg("dry-run", C_Flag, "Don't write the table, just print what we would do"),
+            command_arg("verbose", C_Flag, "Dump all the data to the screen before writing"));
+
+static char *_p_first_lba(struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("%14"PRId64"", p->first_lba); }
+static char *_p_last_lba (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("%14"PRId64"", p->last_lba); }
+static char *_p_size     (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("%14"PRId64" (%9s)", (p->last_lba - p->first_lba + 1) * dev->sector_size,
+                                                                                                                          human_string((p->last_lba - p->first_lba + 1) * dev->sector_size)); }
+static char *_p_guid     (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return guid_format(dalloc(GUID_STR_SIZE), p->partition_guid); }
+static char *_p_flags    (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return dsprintf("implement_me"); }
+static char *_p_misaligned(struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return device_lbas_aligned(dev, p->first_lba, p->last_lba) ? "" : "(misaligned)"; }
+static char *_p_boot     (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return !m ? "" : dsprintf("%s", m->status & MBR_STATUS_BOOTABLE ? "*" : ""); }
+static char *_p_mbr_type (struct gpt_partition *p, struct mbr_partition *m, struct device *dev) { return !m ? "" : dsprintf("%02x", m->partition_type); }
+static char *_p_gpt_type (struct gpt_partition *p, struct mbr_partition *m, struct device *dev)
+{
+    char *names = partition_type_names(p->partition_type);
+    return names ? names : guid_format(dalloc(GUID_STR_SIZE), p->partition_type);
+}
+static char *_p_gpt_label(struct gpt_partition *p, struct mbr_partition *m, struct device *dev)
+{
+    wchar_t name[36];
+    for (int i=0; i<lengthof(name); i++)
+        name[i] = p->name[i];
+    return dsprintf("%.36ls", name);
+}
+
+static int command_print(struct partition_table *t, char **arg)
+{
+    bool verbose = !!arg[1];
+    dalloc_start();
+    printf("%s:\n", t->dev->name);
+    printf("  Disk GUID: %s\n", guid_str(t->header->disk_guid));
+    printf("  %lld %ld byte sectors for %lld total bytes (%s capacity)\n",
+           t->dev->sector_count,  t->dev->sector_size,
+           t->dev->sector_count * t->dev->sector_size,
+           human_string(t->dev->sector_count * t->dev->sector_size));
+    printf("  %ld byte physical blocks", t->dev->physical_block_size);
+    if (t->dev->alignment_offset)
+        printf(" starting at byte %ld", t->dev->alignment_offset);
+    printf(", %ld byte minimum I/O", t->dev->io_min);
+    if (t->dev->io_opt)
+        printf(", %ld byte optimal I/O", t->dev->io_opt);
+    printf("\n");
+    printf("  MBR partition table is %s synced to the GPT table\n", mbr_synced(t) ? "currently" : "not");
+    printf("\n");
+
+    struct printer {
+        char *title;
+        bool right;
+        bool verbose;
+        char *(*print)(struct gpt_partition *p, struct mbr_partition *m, struct device *dev);
+    };
+    struct printer set[] = {
+        { .title="Start LBA", .print= _p_first_lba, .verbose=true, .right = true, },
+        { .title="End LBA",   .print= _p_last_lba,  .verbose=true, .right = true, },
+        { .title="Size",      .print= _p_size,                     .right = true, },
+        { .title="GUID",      .print= _p_guid,      .verbose=true, },
+        { .title="Flags",     .print= _p_flags,     },
+        { .title="B",         .print= _p_boot,      },
+        { .title="MBR",       .print= _p_mbr_type,  },
+        { .title="GPT Type",  .print= _p_gpt_type,  },
+        { .title="Label",     .print= _p_gpt_label, },
+        { .title="",          .print= _p_misaligned, },
+    };
+
+    struct {
+        int width;
+        char *data[t->header->partition_entries];
+    } column[lengthof(set)];
+    memset(column, 0, sizeof(column));
+
+    for (int p=0; p<t->header->partition_entries; p++) {
+        if (guid_eq(gpt_partition_type_empty, t->partition[p].partition_type))
+            continue;
+        for (int c=0; c<lengthof(set); c++) {
+            if (set[c].verbose && !verbose) continue;
+            int m = get_mbr_alias(t, p);
+            column[c].data[p] = set[c].print(&t->partition[p],
+                                             mbr_synced(t) && m != -1 ? &t->mbr.partition[m] : NULL,
+                                             t->dev);
+            if (!column[c].width) column[c].width = strlen(set[c].title);
+            column[c].width = MAX(column[c].width, strlen(column[c].data[p]));
+        }
+    }
+
+#define format(x) ( set[x].right ? "%*s  " : "%-*s  " )
+
+    printf("  ###  ");
+    for (int c=0; c<lengthof(set); c++)
+        if (!set[c].verbose || verbose)
+            printf(format(c), column[c].width, set[c].title);
+    printf("\n");
+    printf("  -----");
+    for (int c=0; c<lengthof(set); c++)
+        if (!set[c].verbose || verbose)
+            printf("%.*s--", column[c].width, "----------------------------------------------------------------------------------------------------------------");
+    printf("\n");
+    for (int p=0; p<t->header->partition_entries; p++) {
+        if (!column[2].data[p]) continue;
+        printf("  %3d) ", p);
+        for (int c=0; c<lengthof(set); c++)
+            if (!set[c].verbose || verbose)
+                printf(format(c), column[c].width, column[c].data[p]);
+        printf("\n");
+    }
+    dalloc_free();
+    return 0;
+}
+command_add("print", command_print, "Print the partition table.",
+            command_arg("verbose", C_Flag, "Print more details"));
+
+static int command_print_mbr(struct partition_table *t, char **arg)
+{
+    int verbose = !!arg[1];
+    printf("    #) %-9s", "Flags");
+    if (verbose) printf(" %-11s %-11s", "Start C:H:S", "End C:H:S");
+    printf(" %10s %22s %s\n", "Start LBA", "Size", "Type");
+    printf("    %.*s\n", verbose ? 98 : 78, "----------------------------------------------------------------------------------------------------------------");
+    for (int i=0; i<lengthof(t->mbr.partition); i++) {
+        if (!t->mbr.partition[i].partition_type) {
+            printf("    %d) Unused entry\n", i);
+            continue;
+        }
+
+        printf("    %d) %02x %6s",
+                   i, t->mbr.partition[i].status, t->mbr.partition[i].status & MBR_STATUS_BOOTABLE ? "(boot)" : "");
+        if (verbose)
+            printf(" %4u:%03u:%02u %4u:%03u:%02u",
+                   t->mbr.partition[i].first_sector.cylinder, t->mbr.partition[i].first_sector.head, t->mbr.partition[i].first_sector.sector,
+                   t->mbr.partition[i].last_sector.cylinder,  t->mbr.partition[i].last_sector.head,  t->mbr.partition[i].last_sector.sector);
+        printf(" %10u %10u (%9s) %02x (%s)\n",
+                   t->mbr.partition[i].first_sector_lba,
+                   t->mbr.partition[i].sectors, human_string((long long)t->mbr.partition[i].sectors * t->dev->sector_size),
+                   t->mbr.partition[i].partition_type,
+                   mbr_partition_type[t->mbr.partition[i].partition_type] ? mbr_partition_type[t->mbr.partition[i].partition_type] : "???");
+    }
+    return 0;
+}
+command_add("print-mbr", command_print_mbr, "Print the MBR partition table.",
+            command_arg("verbose", C_Flag, "Include extra cylinder/head/sector information in output"));
+
+static void dump_dev(struct device *dev)
+{
+    printf("dev.sector_size: %ld\n", dev->sector_size);
+    printf("dev.sector_count: %lld\n", dev->sector_count);
+    printf("dev.physical_block_size: %ld\n", dev->physical_block_size);
+    printf("dev.io_min: %ld\n", dev->io_min);
+    printf("dev.io_opt: %ld\n", dev->io_opt);
+    printf("dev.alignment_offset: %ld\n", dev->alignment_offset);
+    printf("dev.direct_io: %s\n", dev->direct_io ? "yes" : "no");
+    printf("dev.backend: %s\n", dev->backend->name);
+}
+
+static int command_dump_dev(struct partition_table *t, char **arg)
+{
+    dump_dev(t->dev);
+    return 0;
+}
+command_add("debug-dump-dev", command_dump_dev, "Dump device structure");
+
+static void dump_header(struct gpt_header *header)
+{
+    printf("signature[8]         = %.8s\n", header->signature);
+    printf("revision             = %08x\n", header->revision);
+    printf("header_size          = %u\n",   header->header_size);
+    printf("header_crc32         = %08x\n", header->header_crc32);
+    printf("reserved             = %08x\n", header->reserved);
+    printf("my_lba               = %"PRIu64"\n", header->my_lba);
+    printf("alternate_lba        = %"PRIu64"\n", header->alternate_lba);
+    printf("first_usable_lba     = %"PRIu64"\n", header->first_usable_lba);
+    printf("last_usable_lba      = %"PRIu64"\n", header->last_usable_lba);
+    printf("disk_guid            = %s\n",   guid_str(header->disk_guid));
+    printf("partition_entry_lba  = %"PRIu64"\n", header->partition_entry_lba);
+    printf("partition_entries    = %u\n",   header->partition_entries);
+    printf("partition_entry_size = %u\n",   header->partition_entry_size);
+    printf("partition_crc32      = %08x\n", header->partition_crc32);
+}
+
+static int command_dump_header(struct partition_table *t, char **arg)
+{
+    update_table_crc(t);
+    dump_header(arg[1] ? t->alt_header : t->header);
+    printf("(crc32 using %s)\n", gpt_crc32_implementation());
+    return 0;
+}
+command_add("debug-dump-gpt-header", command_dump_header, "Dump GPT header structure",
+            command_arg("alt", C_Flag, "Display the alternate partition header"));
+
+static void dump_partition(struct gpt_partition *p)
+{
+    printf("partition_type = %s\n",   guid_str(p->partition_type));
+    for (struct gpt_partition_type *type = partition_type_from_guid(p->partition_type); type; type = type->next_alias)
+        printf("      * %s\n", type->name);
+    printf("partition_guid = %s\n",   guid_str(p->partition_guid));
+    printf("first_lba      = %"PRId64"\n", p->first_lba);
+    printf("last_lba       = %"PRId64"\n",  p->last_lba);
+    printf("attributes     = %016"PRIx64"\n", p->attributes);
+    wchar_t name[36];
+    for (int i=0; i<lengthof(name); i++)
+        name[i] = p->name[i];
+    printf("name[36]       = %.36ls\n",   name);
+}
+
+static int command_dump_partition(struct partition_table *t, char **arg)
+{
+    for (int i=0; i<t->header->partition_entries; i++) {
+        if (guid_eq(gpt_partition_type_empty, t->partition[i].partition_type))
+            continue;
+        printf("Partition %d of %d\n", i, t->header->partition_entries);
+        dump_partition(&t->partition[i]);
+    }
+    return 0;
+}
+command_add("debug-dump-partition", command_dump_partition, "Dump partitions structure");
+
+static int command_dump_mbr(struct partition_table *t, char **arg)
+{
+    dump_mbr(&t->mbr);
+    return 0;
+}
+command_add("debug-dump-mbr", command_dump_mbr, "Dump MBR structure");
+
+// Some useful library routines. Should maybe go in another file at some point.
+
+static size_t sncatprintf(char *buffer, size_t space, char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    size_t length = strlen(buffer);
+    int count = vsnprintf(buffer + length, space - length, format, ap);
+    va_end(ap);
+    return count;
+}